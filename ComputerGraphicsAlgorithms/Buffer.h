@@ -1,52 +1,399 @@
 #pragma once
 
-#include "framework.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#include "Color.h"
 
 namespace cga
 {
 
+// Byte order in memory. BGRA8 is what the renderer draws in and what a GDI bitmap takes: a Color
+// holding 0x00RRGGBB, alpha is left at 0.
+enum PixelFormat
+{
+	FormatBgra8,
+	FormatRgba8,
+	FormatRgb565,
+	FormatRgba16F
+};
+
+enum BufferLayout
+{
+	// Rows one after another, pitch bytes apart
+	LayoutLinear,
+	// BufferTileSize x BufferTileSize pixel tiles stored contiguously, rows of tiles pitch bytes apart
+	LayoutTiled
+};
+
+// Storage and row alignment, a cache line and enough for aligned AVX loads and stores
+const int BufferAlignment = 64;
+
+// 256 bytes per tile in 32-bit formats, four cache lines
+const int BufferTileSize = 8;
+
+inline int GetBytesPerPixel(PixelFormat format)
+{
+	switch (format)
+	{
+	case FormatRgb565: return 2;
+	case FormatRgba16F: return 8;
+	default: return 4;
+	}
+}
+
+// Half precision conversion for values the renderer produces, tiny values flush to zero
+inline std::uint16_t FloatToHalf(float value)
+{
+	std::uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	const std::uint16_t sign = (std::uint16_t)((bits >> 16) & 0x8000);
+	const int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+	const std::uint32_t mantissa = bits & 0x7FFFFF;
+
+	if (exponent <= 0) return sign;
+	if (exponent >= 31) return sign | 0x7C00;
+
+	// Round to nearest, a carry into the exponent is still the right value
+	return (std::uint16_t)((sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+
+inline float HalfToFloat(std::uint16_t value)
+{
+	const std::uint32_t sign = (std::uint32_t)(value & 0x8000) << 16;
+	const int exponent = (value >> 10) & 0x1F;
+	const std::uint32_t mantissa = value & 0x3FF;
+
+	std::uint32_t bits;
+	if (exponent == 0) bits = sign;
+	else if (exponent == 31) bits = sign | 0x7F800000 | (mantissa << 13);
+	else bits = sign | ((std::uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+
+	float result;
+	std::memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+// Render target: aligned storage with an explicit pitch, one of several pixel formats and an optional tiled layout.
+// The rasterizer draws into BGRA8 buffers through GetPixels and GetIndex, Resolve converts to any format and layout.
 class Buffer
 {
 public:
-	COLORREF* data;
+	Buffer(int aWidth, int aHeight, Color initialColor)
+		: Buffer(aWidth, aHeight, FormatBgra8, LayoutLinear)
+	{
+		ClearWithColor(initialColor);
+	}
 
-	Buffer(int aWidth, int aHeight, COLORREF initialColor)
+	Buffer(int aWidth, int aHeight, PixelFormat aFormat, BufferLayout aLayout)
 		: width(aWidth),
-		height(aHeight)
+		height(aHeight),
+		format(aFormat),
+		layout(aLayout)
 	{
-		totalPixels = width * height;
-		data = static_cast<COLORREF*>(calloc(totalPixels, sizeof(COLORREF)));
+		bytesPerPixel = GetBytesPerPixel(format);
+
+		int rows;
+		if (layout == LayoutTiled)
+		{
+			const int tilesX = (width + BufferTileSize - 1) / BufferTileSize;
+			pitch = tilesX * BufferTileSize * BufferTileSize * bytesPerPixel;
+			rows = (height + BufferTileSize - 1) / BufferTileSize;
+		}
+		else
+		{
+			pitch = width * bytesPerPixel;
+			rows = height;
+		}
+		pitch = (pitch + BufferAlignment - 1) / BufferAlignment * BufferAlignment;
+		pixelPitch = pitch / bytesPerPixel;
+
+		size = (size_t)pitch * rows;
+#if defined(_MSC_VER)
+		bytes = static_cast<unsigned char*>(_aligned_malloc(size, BufferAlignment));
+#else
+		bytes = static_cast<unsigned char*>(std::aligned_alloc(BufferAlignment, size));
+#endif
+		std::memset(bytes, 0, size);
 	}
 
 	~Buffer()
 	{
-		free(data);
+#if defined(_MSC_VER)
+		_aligned_free(bytes);
+#else
+		std::free(bytes);
+#endif
 	}
 
-	inline int GetWidth()
+	Buffer(const Buffer&) = delete;
+	Buffer& operator=(const Buffer&) = delete;
+
+	inline int GetWidth() const
 	{
 		return width;
 	}
 
-	inline int GetHeight()
+	inline int GetHeight() const
 	{
 		return height;
 	}
 
-	// TODO: this is invalid due to bytes order, fix
-	inline void ClearWithColor(COLORREF color)
+	// Bytes between rows, or between rows of tiles in the tiled layout
+	inline int GetPitch() const
+	{
+		return pitch;
+	}
+
+	inline PixelFormat GetFormat() const
+	{
+		return format;
+	}
+
+	inline BufferLayout GetLayout() const
+	{
+		return layout;
+	}
+
+	inline unsigned char* GetData()
+	{
+		return bytes;
+	}
+
+	inline const unsigned char* GetData() const
+	{
+		return bytes;
+	}
+
+	// 32-bit pixels of a BGRA8 or RGBA8 buffer, addressed with GetIndex
+	inline Color* GetPixels()
+	{
+		return reinterpret_cast<Color*>(bytes);
+	}
+
+	inline const Color* GetPixels() const
+	{
+		return reinterpret_cast<const Color*>(bytes);
+	}
+
+	// Position of a pixel in units of pixels
+	inline int GetIndex(int x, int y) const
+	{
+		if (layout == LayoutLinear) return y * pixelPitch + x;
+
+		const int tile = (y / BufferTileSize) * pixelPitch + (x / BufferTileSize) * BufferTileSize * BufferTileSize;
+		return tile + (y % BufferTileSize) * BufferTileSize + x % BufferTileSize;
+	}
+
+	// Only for 32-bit formats, padding is overwritten as well
+	inline void ClearWithColor(Color color)
+	{
+		std::fill_n(GetPixels(), size / sizeof(Color), color);
+	}
+
+	// Right and bottom are exclusive
+	inline void ClearRect(int left, int top, int right, int bottom, Color color)
+	{
+		Color* pixels = GetPixels();
+		for (int y = top; y < bottom; y++)
+		{
+			if (layout == LayoutLinear)
+			{
+				std::fill(pixels + GetIndex(left, y), pixels + GetIndex(right, y), color);
+				continue;
+			}
+
+			for (int x = left; x < right; x++)
+			{
+				pixels[GetIndex(x, y)] = color;
+			}
+		}
+	}
+
+	inline void SetPixel(int x, int y, Color color)
+	{
+		GetPixels()[GetIndex(x, y)] = color;
+	}
+
+	// Channels of any format as 8-bit values
+	inline void GetRgb(int x, int y, std::uint8_t& r, std::uint8_t& g, std::uint8_t& b) const
 	{
-		memset(data, color, totalPixels * sizeof(COLORREF));
+		const unsigned char* pixel = bytes + (size_t)GetIndex(x, y) * bytesPerPixel;
+
+		switch (format)
+		{
+		case FormatBgra8:
+			r = pixel[2]; g = pixel[1]; b = pixel[0];
+			break;
+		case FormatRgba8:
+			r = pixel[0]; g = pixel[1]; b = pixel[2];
+			break;
+		case FormatRgb565:
+		{
+			std::uint16_t value;
+			std::memcpy(&value, pixel, sizeof(value));
+			r = (std::uint8_t)(((value >> 11) & 0x1F) * 255 / 31);
+			g = (std::uint8_t)(((value >> 5) & 0x3F) * 255 / 63);
+			b = (std::uint8_t)((value & 0x1F) * 255 / 31);
+			break;
+		}
+		case FormatRgba16F:
+		{
+			std::uint16_t values[4];
+			std::memcpy(values, pixel, sizeof(values));
+			r = (std::uint8_t)std::clamp(HalfToFloat(values[0]) * 255.0f + 0.5f, 0.0f, 255.0f);
+			g = (std::uint8_t)std::clamp(HalfToFloat(values[1]) * 255.0f + 0.5f, 0.0f, 255.0f);
+			b = (std::uint8_t)std::clamp(HalfToFloat(values[2]) * 255.0f + 0.5f, 0.0f, 255.0f);
+			break;
+		}
+		}
 	}
 
-	inline void SetPixel(int x, int y, COLORREF color)
+	// Stores an 8-bit color in any format, same packing as the BGRA8 frame buffers: 0x00RRGGBB
+	inline void SetColor(int x, int y, Color color)
 	{
-		data[y * width + x] = color;
+		const std::uint8_t r = (std::uint8_t)(color >> 16);
+		const std::uint8_t g = (std::uint8_t)(color >> 8);
+		const std::uint8_t b = (std::uint8_t)color;
+		unsigned char* pixel = bytes + (size_t)GetIndex(x, y) * bytesPerPixel;
+
+		switch (format)
+		{
+		case FormatBgra8:
+			std::memcpy(pixel, &color, sizeof(color));
+			break;
+		case FormatRgba8:
+			pixel[0] = r; pixel[1] = g; pixel[2] = b; pixel[3] = 255;
+			break;
+		case FormatRgb565:
+		{
+			const std::uint16_t value = (std::uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+			std::memcpy(pixel, &value, sizeof(value));
+			break;
+		}
+		case FormatRgba16F:
+		{
+			const std::uint16_t values[4] = { FloatToHalf(r / 255.0f), FloatToHalf(g / 255.0f), FloatToHalf(b / 255.0f), FloatToHalf(1.0f) };
+			std::memcpy(pixel, values, sizeof(values));
+			break;
+		}
+		}
+	}
+
+	// Converts the top left sourceWidth x sourceHeight pixels of this BGRA8 buffer into rows [top, bottom) of the target,
+	// in its format and layout. A smaller source is scaled up bilinearly to the size of the target.
+	void Resolve(Buffer& target, int sourceWidth, int sourceHeight, int top, int bottom) const
+	{
+		if (sourceWidth != target.width || sourceHeight != target.height)
+		{
+			Upscale(target, sourceWidth, sourceHeight, top, bottom);
+			return;
+		}
+
+		const Color* pixels = GetPixels();
+
+		for (int y = top; y < bottom; y++)
+		{
+			// Same layout and format, whole rows at once
+			if (layout == LayoutLinear && target.layout == LayoutLinear && target.format == FormatBgra8)
+			{
+				std::memcpy(target.bytes + (size_t)y * target.pitch, bytes + (size_t)y * pitch, (size_t)target.width * sizeof(Color));
+				continue;
+			}
+
+			for (int x = 0; x < target.width; x++)
+			{
+				target.SetColor(x, y, pixels[GetIndex(x, y)]);
+			}
+		}
 	}
 
 private:
+	// Fixed point bilinear filter, weights in 1/256. Samples are taken at pixel centers, alpha is dropped.
+	void Upscale(Buffer& target, int sourceWidth, int sourceHeight, int top, int bottom) const
+	{
+		const Color* pixels = GetPixels();
+
+		// Columns are the same for every row
+		struct Span
+		{
+			int first, second, weight;
+		};
+		std::vector<Span> columns(target.width);
+		for (int x = 0; x < target.width; x++)
+		{
+			GetSourceSpan(x, target.width, sourceWidth, columns[x].first, columns[x].second, columns[x].weight);
+		}
+
+		// The usual case, linear buffers and a BGRA8 target, reads and writes whole rows without GetIndex and SetColor
+		if (layout == LayoutLinear && target.layout == LayoutLinear && target.format == FormatBgra8)
+		{
+			for (int y = top; y < bottom; y++)
+			{
+				int y0, y1, weightY;
+				GetSourceSpan(y, target.height, sourceHeight, y0, y1, weightY);
+				const Color* upperRow = pixels + (size_t)y0 * pixelPitch;
+				const Color* lowerRow = pixels + (size_t)y1 * pixelPitch;
+				Color* row = reinterpret_cast<Color*>(target.bytes + (size_t)y * target.pitch);
+
+				for (int x = 0; x < target.width; x++)
+				{
+					const Span& column = columns[x];
+					const Color upper = Lerp(upperRow[column.first], upperRow[column.second], column.weight);
+					const Color lower = Lerp(lowerRow[column.first], lowerRow[column.second], column.weight);
+					row[x] = Lerp(upper, lower, weightY);
+				}
+			}
+			return;
+		}
+
+		for (int y = top; y < bottom; y++)
+		{
+			int y0, y1, weightY;
+			GetSourceSpan(y, target.height, sourceHeight, y0, y1, weightY);
+
+			for (int x = 0; x < target.width; x++)
+			{
+				const Span& column = columns[x];
+				const Color upper = Lerp(pixels[GetIndex(column.first, y0)], pixels[GetIndex(column.second, y0)], column.weight);
+				const Color lower = Lerp(pixels[GetIndex(column.first, y1)], pixels[GetIndex(column.second, y1)], column.weight);
+				target.SetColor(x, y, Lerp(upper, lower, weightY));
+			}
+		}
+	}
+
+	// Source pixels around the center of a target pixel and the weight of the second one
+	static inline void GetSourceSpan(int position, int targetSize, int sourceSize, int& first, int& second, int& weight)
+	{
+		const long long center = std::max(((2LL * position + 1) * sourceSize * 128) / targetSize - 128, 0LL);
+		first = (int)(center >> 8);
+		second = std::min(first + 1, sourceSize - 1);
+		weight = (int)(center & 0xFF);
+	}
+
+	// Red and blue are blended together, 8 bits apart is enough room for the products
+	static inline Color Lerp(Color a, Color b, int weight)
+	{
+		const Color redBlue = (((a & 0xFF00FF) * (256 - weight) + (b & 0xFF00FF) * weight) >> 8) & 0xFF00FF;
+		const Color green = (((a & 0x00FF00) * (256 - weight) + (b & 0x00FF00) * weight) >> 8) & 0x00FF00;
+		return redBlue | green;
+	}
+
 	int width, height;
-	int totalPixels;
+	PixelFormat format;
+	BufferLayout layout;
+	int bytesPerPixel;
+	int pitch, pixelPitch;
+	size_t size;
+	unsigned char* bytes;
 };
 
 }
@@ -0,0 +1,74 @@
+#include "CacheFile.h"
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+namespace cga
+{
+
+std::string CacheFile::GetPath(const std::string& sourcePath)
+{
+	return sourcePath + ".cache";
+}
+
+bool CacheFile::GetKey(const std::string& sourcePath, const char (&magic)[4], std::uint32_t version, CacheKey& key)
+{
+	std::error_code error;
+	const auto size = std::filesystem::file_size(sourcePath, error);
+	if (error) return false;
+	const auto time = std::filesystem::last_write_time(sourcePath, error);
+	if (error) return false;
+
+	std::memset(&key, 0, sizeof(key));
+	std::memcpy(key.magic, magic, sizeof(key.magic));
+	key.version = version;
+	key.sourceSize = size;
+	key.sourceTime = time.time_since_epoch().count();
+	key.pathLength = (std::uint32_t)sourcePath.size();
+	return true;
+}
+
+std::uint64_t CacheFile::GetDataOffset(std::size_t headerSize, const CacheKey& key, std::uint64_t alignment)
+{
+	return (headerSize + key.pathLength + alignment - 1) / alignment * alignment;
+}
+
+bool CacheFile::Matches(const MappedFile& file, std::size_t headerSize, const std::string& sourcePath, const CacheKey& expected, const CacheKey& actual)
+{
+	if (std::memcmp(actual.magic, expected.magic, sizeof(actual.magic)) != 0 || actual.version != expected.version ||
+		actual.sourceSize != expected.sourceSize || actual.sourceTime != expected.sourceTime || actual.pathLength != expected.pathLength) return false;
+
+	return headerSize + actual.pathLength <= file.GetSize() && std::memcmp(file.GetData() + headerSize, sourcePath.data(), actual.pathLength) == 0;
+}
+
+void CacheFile::Write(const std::string& sourcePath, const void* header, std::size_t headerSize, const std::function<void(std::ofstream&)>& writeData)
+{
+	const std::string cachePath = GetPath(sourcePath);
+	// An abandoned load of the same file may still be writing, each write gets its own temporary file
+	static std::atomic<unsigned> writeCount = 0;
+	const std::string temporaryPath = cachePath + "." + std::to_string(writeCount++) + ".tmp";
+
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return;
+
+		file.write(static_cast<const char*>(header), (std::streamsize)headerSize);
+		file.write(sourcePath.data(), (std::streamsize)sourcePath.size());
+		writeData(file);
+
+		if (!file.good())
+		{
+			file.close();
+			std::remove(temporaryPath.c_str());
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, cachePath, error);
+	if (error) std::remove(temporaryPath.c_str());
+}
+
+}
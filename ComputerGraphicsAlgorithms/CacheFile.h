@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "MappedFile.h"
+
+namespace cga
+{
+
+// Identifies the source a cache file was built from. Every cache header starts with one, the source path follows the header.
+struct CacheKey
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint64_t sourceSize;
+	std::int64_t sourceTime;
+	std::uint32_t pathLength;
+	std::uint32_t reserved;
+};
+
+// Binary caches stored next to their source file. A cache is used while its magic and format version are current
+// and the path, modification time and size of the source match the ones it was built from, and is rebuilt otherwise.
+// It is written to a temporary file first so a reader never maps a partial cache, failures only cost the next load.
+class CacheFile
+{
+public:
+	static std::string GetPath(const std::string& sourcePath);
+
+	// False when the source can't be examined
+	static bool GetKey(const std::string& sourcePath, const char (&magic)[4], std::uint32_t version, CacheKey& key);
+
+	// Maps the cache of the source and copies its header out, the header's first member is its CacheKey.
+	// False when there is no cache or it was built from something else.
+	template <typename Header>
+	static inline bool Open(const std::string& sourcePath, const CacheKey& key, MappedFile& file, Header& header)
+	{
+		if (!file.Open(GetPath(sourcePath)) || file.GetSize() < sizeof(Header)) return false;
+
+		std::memcpy(&header, file.GetData(), sizeof(header));
+		return Matches(file, sizeof(Header), sourcePath, key, header.key);
+	}
+
+	// First offset after the header and the source path that is a multiple of alignment
+	static std::uint64_t GetDataOffset(std::size_t headerSize, const CacheKey& key, std::uint64_t alignment);
+
+	// Writes the header and the source path, then whatever writeData writes after them
+	template <typename Header>
+	static inline void Write(const std::string& sourcePath, const Header& header, const std::function<void(std::ofstream&)>& writeData)
+	{
+		Write(sourcePath, &header, sizeof(Header), writeData);
+	}
+
+private:
+	static bool Matches(const MappedFile& file, std::size_t headerSize, const std::string& sourcePath, const CacheKey& expected, const CacheKey& actual);
+	static void Write(const std::string& sourcePath, const void* header, std::size_t headerSize, const std::function<void(std::ofstream&)>& writeData);
+};
+
+}
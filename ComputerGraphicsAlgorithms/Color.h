@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace cga
+{
+
+// Platform-neutral replacement for COLORREF, same 0x00BBGGRR layout as the RGB macro
+typedef std::uint32_t Color;
+
+inline constexpr Color MakeRgb(std::uint8_t r, std::uint8_t g, std::uint8_t b)
+{
+	return static_cast<Color>(r) | (static_cast<Color>(g) << 8) | (static_cast<Color>(b) << 16);
+}
+
+inline constexpr std::uint8_t GetRed(Color color)
+{
+	return static_cast<std::uint8_t>(color);
+}
+
+inline constexpr std::uint8_t GetGreen(Color color)
+{
+	return static_cast<std::uint8_t>(color >> 8);
+}
+
+inline constexpr std::uint8_t GetBlue(Color color)
+{
+	return static_cast<std::uint8_t>(color >> 16);
+}
+
+}
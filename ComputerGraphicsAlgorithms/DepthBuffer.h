@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+namespace cga
+{
+
+enum DepthFormat
+{
+	// Float in [0, 1], near plane at 0
+	DepthFloat32,
+	// Unsigned normalized, same orientation as DepthFloat32
+	DepthUnorm16,
+	DepthUnorm24,
+	// Float with the near plane at 1 and the far plane at 0, which spreads float precision evenly over distance
+	DepthReversedFloat32
+};
+
+// The rasterizer works with depth keys where smaller is nearer, so one less-than test and one max-depth
+// hierarchy serve every format. Keys are the screen space depth, negated for reversed formats.
+// Encoding is monotonic, so a key that is not less than a decoded value can't pass against the stored one.
+template <DepthFormat Format>
+struct DepthTraits;
+
+template <>
+struct DepthTraits<DepthFloat32>
+{
+	typedef float Type;
+	static constexpr bool Reversed = false;
+	static constexpr float ClearKey = 1.0f;
+
+	static inline Type Encode(float key) { return key; }
+	static inline float Decode(Type value) { return value; }
+};
+
+template <>
+struct DepthTraits<DepthUnorm16>
+{
+	typedef std::uint16_t Type;
+	static constexpr bool Reversed = false;
+	static constexpr float ClearKey = 1.0f;
+	static constexpr float Scale = 65535.0f;
+
+	// Keys past the far plane saturate to the clear value and never pass
+	static inline Type Encode(float key) { return (Type)std::clamp(key * Scale + 0.5f, 0.0f, Scale); }
+	static inline float Decode(Type value) { return value / Scale; }
+};
+
+template <>
+struct DepthTraits<DepthUnorm24>
+{
+	typedef std::uint32_t Type;
+	static constexpr bool Reversed = false;
+	static constexpr float ClearKey = 1.0f;
+	static constexpr double Scale = 16777215.0;
+
+	static inline Type Encode(float key) { return (Type)std::clamp(key * Scale + 0.5, 0.0, Scale); }
+	static inline float Decode(Type value) { return (float)(value / Scale); }
+};
+
+template <>
+struct DepthTraits<DepthReversedFloat32>
+{
+	typedef float Type;
+	static constexpr bool Reversed = true;
+	static constexpr float ClearKey = 0.0f;
+
+	static inline Type Encode(float key) { return key; }
+	static inline float Decode(Type value) { return value; }
+};
+
+inline bool IsReversed(DepthFormat format)
+{
+	return format == DepthReversedFloat32;
+}
+
+// Untyped z-buffer storage, sized for the widest format so switching formats never reallocates.
+// Narrower formats simply use the front of it.
+class DepthBuffer
+{
+public:
+	DepthBuffer(int aWidth, int aHeight)
+		: width(aWidth),
+		height(aHeight)
+	{
+		data = calloc((size_t)width * height, sizeof(std::uint32_t));
+	}
+
+	~DepthBuffer()
+	{
+		free(data);
+	}
+
+	DepthBuffer(const DepthBuffer&) = delete;
+	DepthBuffer& operator=(const DepthBuffer&) = delete;
+
+	template <DepthFormat Format>
+	inline typename DepthTraits<Format>::Type* GetData()
+	{
+		return static_cast<typename DepthTraits<Format>::Type*>(data);
+	}
+
+	inline int GetWidth() const
+	{
+		return width;
+	}
+
+	inline int GetHeight() const
+	{
+		return height;
+	}
+
+private:
+	int width, height;
+	void* data;
+};
+
+}
@@ -1,6 +1,6 @@
 #include "Game.h"
 
-#include "ObjParser.h"
+#include "framework.h"
 #include "Math.h"
 #include "Camera.h"
 
@@ -24,6 +24,8 @@ Buffer& Game::GetCurrentBuffer()
 
 void Game::GameCycle()
 {
+	UpdateLoading();
+
 	if (scene == nullptr) return;
 
 	auto currentTick = getTickCountCallback();
@@ -37,11 +39,25 @@ void Game::GameCycle()
 	{
 		OnUpdated();
 	}
+	else
+	{
+		// Present the last frame once the camera stops
+		renderer.Flush();
+
+		// and draw the still view once more at full resolution
+		if (!stillFrameRendered && renderer.GetResolutionScale() < 1.0f)
+		{
+			stillFrameRendered = true;
+			renderer.ResetResolutionScale();
+			renderer.Render(scene);
+		}
+	}
 }
 
 void Game::OnUpdated()
 {
 	updated = false;
+	stillFrameRendered = false;
 	renderer.Render(scene);
 }
 
@@ -114,6 +130,10 @@ void Game::OnKeyUp(unsigned int virtualKeyCode)
 	{
 		ToggleMouse();
 	}
+	else if (virtualKeyCode == 0x52)
+	{
+		ToggleDynamicResolution();
+	}
 }
 
 void Game::ToggleMouse()
@@ -122,6 +142,15 @@ void Game::ToggleMouse()
 	ShowCursor(mouseVisible);
 }
 
+void Game::ToggleDynamicResolution()
+{
+	dynamicResolution = !dynamicResolution;
+	renderer.SetDynamicResolution(dynamicResolution, FrameBudget);
+
+	// The frames were reallocated, nothing is left to present
+	updated = true;
+}
+
 void Game::OnWheelScroll(int delta)
 {
 	if (scene == nullptr) return;
@@ -135,14 +164,6 @@ void Game::OnWheelScroll(int delta)
 
 void Game::LoadScene(std::string pathToObject)
 {
-	ObjParser parser;
-	auto loadedObj = parser.Parse(pathToObject);
-	if (loadedObj)
-	{
-		scene = std::make_unique<Scene>(Camera(glm::vec3(0.0f, 0.0f, 2.5f)), loadedObj.value());
-		firstMouse = true;
-		updated = true;
-	}
 	int i = pathToObject.size();
     for (; i >= 0; i--) {
 		if (pathToObject[i] == '\\')
@@ -150,7 +171,78 @@ void Game::LoadScene(std::string pathToObject)
 			break;
 		}
 	}
-	renderer.SetMaps(pathToObject.substr(0, i));
+
+	// A load still in progress is dropped, along with its proxy
+	if (showingProxy)
+	{
+		renderer.Flush();
+		scene = std::move(previousScene);
+		showingProxy = false;
+	}
+
+	loader.Start(pathToObject, pathToObject.substr(0, i));
+}
+
+void Game::UpdateLoading()
+{
+	loader.ReleaseAbandoned();
+	if (!loader.IsLoading()) return;
+
+	if (loader.IsMeshReady())
+	{
+		auto loadedObj = loader.TakeMesh();
+		if (loadedObj)
+		{
+			ShowMesh(std::move(*loadedObj));
+		}
+		else if (showingProxy)
+		{
+			renderer.Flush();
+			scene = std::move(previousScene);
+			updated = true;
+		}
+
+		// Both flushed, no frame in flight reads the scene the proxy replaced any more
+		previousScene.reset();
+		showingProxy = false;
+	}
+	else if (loader.IsProxyReady())
+	{
+		auto proxyObj = loader.TakeProxy();
+		if (proxyObj)
+		{
+			previousScene = std::move(scene);
+			ShowMesh(std::move(*proxyObj));
+			showingProxy = true;
+		}
+	}
+
+	if (loader.AreMapsReady())
+	{
+		renderer.SetMaps(loader.TakeMaps());
+		updated = true;
+	}
+}
+
+void Game::ShowMesh(Obj obj)
+{
+	// The frame in flight still reads the old mesh
+	renderer.Flush();
+
+	// Shading can't do without maps, the mesh is untextured until they are in
+	if (loader.AreMapsPending()) renderer.SetMaps(Renderer::CreateProxyMaps());
+
+	// The full mesh keeps the view of its proxy
+	if (showingProxy)
+	{
+		scene = std::make_unique<Scene>(scene->camera, std::move(obj));
+	}
+	else
+	{
+		scene = std::make_unique<Scene>(Camera(glm::vec3(0.0f, 0.0f, 2.5f)), std::move(obj));
+		firstMouse = true;
+	}
+	updated = true;
 }
 
 }
\ No newline at end of file
@@ -8,12 +8,16 @@
 #include "Buffer.h"
 #include "Scene.h"
 #include "Renderer.h"
+#include "SceneLoader.h"
 
 namespace cga
 {
 
 const int AngleStep = 1;
 
+// Rasterization time per frame while the camera moves, frames are drawn at a lower resolution to keep it
+const float FrameBudget = 1000.0f / 60;
+
 class Game
 {
 public:
@@ -23,21 +27,42 @@ public:
 	void OnKeyDown(unsigned int virtualKeyCode);
 	void OnKeyUp(unsigned int virtualKeyCode);
 	void ToggleMouse();
+
+	// R key, off by default: moving frames are drawn at a lower resolution to hold FrameBudget
+	void ToggleDynamicResolution();
 	void OnWheelScroll(int delta);
 
 	Buffer& GetCurrentBuffer();
 
+	// Starts loading in the background, GameCycle shows a proxy and then the scene as they become ready
 	void LoadScene(std::string pathToObject);
 
+	inline bool IsLoading() const
+	{
+		return loader.IsLoading();
+	}
+
+	inline float GetLoadingProgress() const
+	{
+		return loader.GetProgress();
+	}
+
 	void GameCycle();
 
 private:
 	std::unique_ptr<Scene> scene;
 	Renderer renderer;
 
+	SceneLoader loader;
+	bool showingProxy = false;
+	// Shown again when the mesh whose proxy replaced it fails to load
+	std::unique_ptr<Scene> previousScene;
+
 	unsigned long long lastTick, deltaTime = 0;
 
 	bool updated = false;
+	bool stillFrameRendered = false;
+	bool dynamicResolution = false;
 	std::vector<bool> keyStates;
 
 	int width, height;
@@ -51,6 +76,10 @@ private:
 	void RotateCamera();
 
 	void OnUpdated();
+
+	// Swaps in whatever the loader finished, between frames
+	void UpdateLoading();
+	void ShowMesh(Obj obj);
 };
 
 }
@@ -0,0 +1,248 @@
+// Headless.cpp : offscreen entry point, renders frames without a window and writes them as PNG
+//
+// Usage: Headless <scene.obj> [--maps <dir>] [--frames <n>] [--size <width>x<height>]
+//                 [--camera <x> <y> <z>] [--yaw <deg>] [--pitch <deg>] [--fov <deg>] [--output <prefix>]
+//                 [--deferred] [--filter point|bilinear|trilinear] [--depth float|unorm16|unorm24|reversed]
+//                 [--format bgra8|rgba8|rgb565|rgba16f] [--tiled] [--budget <ms>]
+//
+// --budget turns on dynamic resolution with that rasterization time per frame.
+// Maps directory defaults to the directory of the .obj file. Without --output nothing is written,
+// which is what you want for throughput measurement.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Renderer.h"
+#include "MeshCache.h"
+#include "Scene.h"
+#include "Camera.h"
+
+#include "lodepng.h"
+
+namespace
+{
+
+struct Options
+{
+	std::string objPath;
+	std::string mapsPath;
+	std::string outputPrefix;
+	int frames = 1;
+	int width = 1920;
+	int height = 1080;
+	glm::vec3 cameraPosition = glm::vec3(0.0f, 0.0f, 2.5f);
+	float yaw = cga::YAW;
+	float pitch = cga::PITCH;
+	float fov = cga::DEFAULT_FOV;
+	bool deferred = false;
+	cga::TextureFilter filter = cga::FilterTrilinear;
+	cga::DepthFormat depthFormat = cga::DepthFloat32;
+	cga::PixelFormat outputFormat = cga::FormatBgra8;
+	bool tiled = false;
+	float budget = 0;
+};
+
+void PrintUsage()
+{
+	std::fprintf(stderr,
+		"Usage: Headless <scene.obj> [--maps <dir>] [--frames <n>] [--size <width>x<height>]\n"
+		"                [--camera <x> <y> <z>] [--yaw <deg>] [--pitch <deg>] [--fov <deg>] [--output <prefix>]\n"
+		"                [--deferred] [--filter point|bilinear|trilinear] [--depth float|unorm16|unorm24|reversed]\n"
+		"                [--format bgra8|rgba8|rgb565|rgba16f] [--tiled] [--budget <ms>]\n");
+}
+
+bool ParseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto hasValues = [&](int count) { return i + count < argc; };
+
+		if (arg == "--maps" && hasValues(1))
+		{
+			options.mapsPath = argv[++i];
+		}
+		else if (arg == "--frames" && hasValues(1))
+		{
+			options.frames = std::atoi(argv[++i]);
+		}
+		else if (arg == "--size" && hasValues(1))
+		{
+			if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) return false;
+		}
+		else if (arg == "--camera" && hasValues(3))
+		{
+			options.cameraPosition.x = std::strtof(argv[++i], nullptr);
+			options.cameraPosition.y = std::strtof(argv[++i], nullptr);
+			options.cameraPosition.z = std::strtof(argv[++i], nullptr);
+		}
+		else if (arg == "--yaw" && hasValues(1))
+		{
+			options.yaw = std::strtof(argv[++i], nullptr);
+		}
+		else if (arg == "--pitch" && hasValues(1))
+		{
+			options.pitch = std::strtof(argv[++i], nullptr);
+		}
+		else if (arg == "--fov" && hasValues(1))
+		{
+			options.fov = std::strtof(argv[++i], nullptr);
+		}
+		else if (arg == "--output" && hasValues(1))
+		{
+			options.outputPrefix = argv[++i];
+		}
+		else if (arg == "--deferred")
+		{
+			options.deferred = true;
+		}
+		else if (arg == "--filter" && hasValues(1))
+		{
+			const std::string filter = argv[++i];
+			if (filter == "point") options.filter = cga::FilterPoint;
+			else if (filter == "bilinear") options.filter = cga::FilterBilinear;
+			else if (filter == "trilinear") options.filter = cga::FilterTrilinear;
+			else return false;
+		}
+		else if (arg == "--depth" && hasValues(1))
+		{
+			const std::string format = argv[++i];
+			if (format == "float") options.depthFormat = cga::DepthFloat32;
+			else if (format == "unorm16") options.depthFormat = cga::DepthUnorm16;
+			else if (format == "unorm24") options.depthFormat = cga::DepthUnorm24;
+			else if (format == "reversed") options.depthFormat = cga::DepthReversedFloat32;
+			else return false;
+		}
+		else if (arg == "--format" && hasValues(1))
+		{
+			const std::string format = argv[++i];
+			if (format == "bgra8") options.outputFormat = cga::FormatBgra8;
+			else if (format == "rgba8") options.outputFormat = cga::FormatRgba8;
+			else if (format == "rgb565") options.outputFormat = cga::FormatRgb565;
+			else if (format == "rgba16f") options.outputFormat = cga::FormatRgba16F;
+			else return false;
+		}
+		else if (arg == "--tiled")
+		{
+			options.tiled = true;
+		}
+		else if (arg == "--budget" && hasValues(1))
+		{
+			options.budget = std::strtof(argv[++i], nullptr);
+			if (options.budget <= 0) return false;
+		}
+		else if (arg[0] != '-' && options.objPath.empty())
+		{
+			options.objPath = arg;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (options.mapsPath.empty())
+	{
+		options.mapsPath = std::filesystem::path(options.objPath).parent_path().string();
+		if (options.mapsPath.empty()) options.mapsPath = ".";
+	}
+
+	return !options.objPath.empty() && options.frames > 0 && options.width > 0 && options.height > 0;
+}
+
+// lodepng wants tightly packed RGBA bytes, the buffer may be in any format and padded
+bool WritePng(const cga::Buffer& buffer, const std::string& fileName)
+{
+	const int width = buffer.GetWidth();
+	const int height = buffer.GetHeight();
+	std::vector<unsigned char> image(width * height * 4);
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			unsigned char* pixel = &image[(y * width + x) * 4];
+			buffer.GetRgb(x, y, pixel[0], pixel[1], pixel[2]);
+			pixel[3] = 255;
+		}
+	}
+
+	return lodepng::encode(fileName, image, width, height) == 0;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	using Clock = std::chrono::steady_clock;
+
+	auto loadStart = Clock::now();
+
+	auto loadedObj = cga::MeshCache().Load(options.objPath);
+	if (!loadedObj)
+	{
+		std::fprintf(stderr, "Failed to load %s\n", options.objPath.c_str());
+		return 1;
+	}
+
+	cga::Renderer renderer(options.width, options.height, []() {});
+	renderer.SetMaps(options.mapsPath);
+	renderer.SetDeferredShading(options.deferred);
+	renderer.SetTextureFilter(options.filter);
+	renderer.SetDepthFormat(options.depthFormat);
+	renderer.SetOutputFormat(options.outputFormat);
+	renderer.SetBufferLayout(options.tiled ? cga::LayoutTiled : cga::LayoutLinear);
+	if (options.budget > 0) renderer.SetDynamicResolution(true, options.budget);
+
+	cga::Camera camera(options.cameraPosition, glm::vec3(0.0f, 1.0f, 0.0f), options.yaw, options.pitch);
+	camera.FOV = options.fov;
+	auto scene = std::make_unique<cga::Scene>(camera, std::move(*loadedObj));
+
+	auto loadTime = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+	std::printf("Loaded %zu vertices, %zu polygons in %.1f ms\n", scene->obj.vertices.size(), scene->obj.polygons.size(), loadTime);
+
+	// Frames are pipelined, Render presents the previous one. When writing images every frame is flushed,
+	// so they come out in order, which also turns the overlap off.
+	const bool writeFrames = !options.outputPrefix.empty();
+
+	double totalTime = 0;
+	for (int frame = 0; frame < options.frames; frame++)
+	{
+		auto frameStart = Clock::now();
+		renderer.Render(scene);
+		if (writeFrames || frame == options.frames - 1) renderer.Flush();
+		auto frameTime = std::chrono::duration<double, std::milli>(Clock::now() - frameStart).count();
+		totalTime += frameTime;
+
+		std::printf("Frame %d: %.2f ms, resolution scale %.4g\n", frame, frameTime, renderer.GetResolutionScale());
+
+		if (writeFrames)
+		{
+			char suffix[16];
+			std::snprintf(suffix, sizeof(suffix), "_%04d.png", frame);
+			if (!WritePng(renderer.GetCurrentBuffer(), options.outputPrefix + suffix))
+			{
+				std::fprintf(stderr, "Failed to write %s%s\n", options.outputPrefix.c_str(), suffix);
+				return 1;
+			}
+		}
+	}
+
+	std::printf("Average: %.2f ms/frame (%.1f fps) over %d frames\n", totalTime / options.frames, 1000.0 * options.frames / totalTime, options.frames);
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "DepthBuffer.h"
+
+namespace cga
+{
+
+// Two level max-depth hierarchy over a z-buffer: the farthest stored depth per block and per tile.
+// Anything whose nearest depth is not closer than that maximum can't pass the depth test there.
+// Depths are kept as decoded keys, see DepthTraits.
+class HiZBuffer
+{
+public:
+	void Resize(int aWidth, int aHeight, int aBlockSize, int aTileSize)
+	{
+		width = aWidth;
+		height = aHeight;
+		blockSize = aBlockSize;
+		tileSize = aTileSize;
+		blocksPerTile = tileSize / blockSize;
+
+		blocksX = (width + blockSize - 1) / blockSize;
+		blocksY = (height + blockSize - 1) / blockSize;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+
+		blockMax.assign(blocksX * blocksY, 1.0f);
+		tileMax.assign(tilesX * tilesY, 1.0f);
+	}
+
+	inline void Clear(float depth)
+	{
+		std::fill(blockMax.begin(), blockMax.end(), depth);
+		std::fill(tileMax.begin(), tileMax.end(), depth);
+	}
+
+	// Resets one tile and its blocks
+	inline void ClearTile(int tileX, int tileY, float depth)
+	{
+		const int firstBlockX = tileX * blocksPerTile;
+		const int firstBlockY = tileY * blocksPerTile;
+		const int lastBlockX = std::min(firstBlockX + blocksPerTile, blocksX);
+		const int lastBlockY = std::min(firstBlockY + blocksPerTile, blocksY);
+
+		for (int blockY = firstBlockY; blockY < lastBlockY; blockY++)
+		{
+			std::fill(blockMax.begin() + blockY * blocksX + firstBlockX, blockMax.begin() + blockY * blocksX + lastBlockX, depth);
+		}
+
+		tileMax[tileY * tilesX + tileX] = depth;
+	}
+
+	inline float GetBlockMax(int blockX, int blockY) const
+	{
+		return blockMax[blockY * blocksX + blockX];
+	}
+
+	inline float GetTileMax(int tileX, int tileY) const
+	{
+		return tileMax[tileY * tilesX + tileX];
+	}
+
+	// Recomputes a block after its pixels were written
+	template <DepthFormat Format>
+	inline void UpdateBlock(const typename DepthTraits<Format>::Type* zBuffer, int blockX, int blockY)
+	{
+		const int left = blockX * blockSize;
+		const int top = blockY * blockSize;
+		const int right = std::min(left + blockSize, width);
+		const int bottom = std::min(top + blockSize, height);
+
+		// Encoding is monotonic, so only the maximum needs decoding
+		auto maxDepth = std::numeric_limits<typename DepthTraits<Format>::Type>::lowest();
+		for (int y = top; y < bottom; y++)
+		{
+			for (int x = left; x < right; x++)
+			{
+				maxDepth = std::max(maxDepth, zBuffer[y * width + x]);
+			}
+		}
+
+		blockMax[blockY * blocksX + blockX] = DepthTraits<Format>::Decode(maxDepth);
+	}
+
+	// Recomputes a tile from its blocks
+	inline void UpdateTile(int tileX, int tileY)
+	{
+		const int firstBlockX = tileX * blocksPerTile;
+		const int firstBlockY = tileY * blocksPerTile;
+		const int lastBlockX = std::min(firstBlockX + blocksPerTile, blocksX);
+		const int lastBlockY = std::min(firstBlockY + blocksPerTile, blocksY);
+
+		float maxDepth = std::numeric_limits<float>::lowest();
+		for (int blockY = firstBlockY; blockY < lastBlockY; blockY++)
+		{
+			for (int blockX = firstBlockX; blockX < lastBlockX; blockX++)
+			{
+				maxDepth = std::max(maxDepth, blockMax[blockY * blocksX + blockX]);
+			}
+		}
+
+		tileMax[tileY * tilesX + tileX] = maxDepth;
+	}
+
+private:
+	int width = 0, height = 0;
+	int blockSize = 1, tileSize = 1, blocksPerTile = 1;
+	int blocksX = 0, blocksY = 0;
+	int tilesX = 0, tilesY = 0;
+
+	std::vector<float> blockMax;
+	std::vector<float> tileMax;
+};
+
+}
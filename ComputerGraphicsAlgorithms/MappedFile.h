@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace cga
+{
+
+// Read-only view of a whole file mapped into memory, pages are loaded on first access
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const std::string& fileName);
+	void Close();
+
+	inline const unsigned char* GetData() const
+	{
+		return data;
+	}
+
+	inline std::size_t GetSize() const
+	{
+		return size;
+	}
+
+private:
+	const unsigned char* data = nullptr;
+	std::size_t size = 0;
+
+#if defined(_WIN32)
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
+
+}
@@ -109,6 +109,21 @@ inline glm::mat4 GetPerspectiveProjectionMatrix(float width, float height, float
 	};
 }
 
+// Maps the near plane to depth 1 and the far plane to 0
+inline glm::mat4 GetReversedPerspectiveProjectionMatrix(float width, float height, float zNear, float zFar, float FOV)
+{
+	float tanFOVHalved = glm::tan(glm::radians(FOV / 2));
+	float deltaZ = zFar - zNear;
+	float aspect = width / height;
+
+	return glm::mat4 {
+		1 / (aspect * tanFOVHalved), 0, 0, 0,
+		0, 1 / tanFOVHalved, 0, 0,
+		0, 0, zNear / deltaZ, -1,
+		0, 0, zNear * zFar / deltaZ, 0
+	};
+}
+
 inline glm::mat4 GetOrthographicProjectionMatrix(float width, float height, float zNear, float zFar)
 {
 	float deltaZ = zNear - zFar;
@@ -0,0 +1,159 @@
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#include "MeshletBuilder.h"
+#include "MeshOptimizer.h"
+#include "ObjParser.h"
+#include "TangentBuilder.h"
+
+namespace cga
+{
+
+namespace
+{
+
+const char MeshCacheMagic[4] = { 'C', 'G', 'A', 'M' };
+
+}
+
+std::optional<Obj> MeshCache::Load(const std::string& sourcePath)
+{
+	CacheKey key;
+	if (!CacheFile::GetKey(sourcePath, MeshCacheMagic, MeshCacheVersion, key)) return {};
+
+	auto obj = Map(sourcePath, key);
+	if (obj) return obj;
+
+	obj = ObjParser().Parse(sourcePath);
+	if (!obj) return obj;
+
+	// Everything the renderer needs besides the file contents, stored so that a warm load skips it
+	MeshOptimizer optimizer;
+	optimizer.Optimize(*obj);
+	MeshletBuilder().Build(*obj);
+	optimizer.SortMeshlets(*obj);
+	TangentBuilder().Build(*obj);
+
+	Write(sourcePath, key, *obj);
+	return obj;
+}
+
+bool MeshCache::LoadBounds(const std::string& sourcePath, glm::vec3& boundsMin, glm::vec3& boundsMax)
+{
+	CacheKey key;
+	if (!CacheFile::GetKey(sourcePath, MeshCacheMagic, MeshCacheVersion, key)) return false;
+
+	MappedFile file;
+	Header header;
+	if (CacheFile::Open(sourcePath, key, file, header))
+	{
+		boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+		boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+		return header.counts[SectionVertices] > 0;
+	}
+
+	return ObjParser().ParseBounds(sourcePath, boundsMin, boundsMax);
+}
+
+std::optional<Obj> MeshCache::Map(const std::string& sourcePath, const CacheKey& key)
+{
+	MappedFile file;
+	Header header;
+	if (!CacheFile::Open(sourcePath, key, file, header)) return {};
+
+	// The index buffers are parallel, one entry per polygon each
+	const std::uint64_t polygonsCount = header.counts[SectionVerticesIndices];
+	if (header.counts[SectionTextureIndices] != polygonsCount || header.counts[SectionNormalsIndices] != polygonsCount
+		|| header.counts[SectionTangentsIndices] != polygonsCount) return {};
+
+	Obj obj;
+	if (!ReadSection(file, header, SectionVertices, obj.vertices) ||
+		!ReadSection(file, header, SectionTextureCoords, obj.textureCoords) ||
+		!ReadSection(file, header, SectionNormals, obj.normals) ||
+		!ReadSection(file, header, SectionTangents, obj.tangents) ||
+		!ReadSection(file, header, SectionVerticesIndices, obj.polygons.verticesIndices) ||
+		!ReadSection(file, header, SectionTextureIndices, obj.polygons.textureIndices) ||
+		!ReadSection(file, header, SectionNormalsIndices, obj.polygons.normalsIndices) ||
+		!ReadSection(file, header, SectionTangentsIndices, obj.polygons.tangentsIndices) ||
+		!ReadSection(file, header, SectionMeshlets, obj.meshlets)) return {};
+
+	// A damaged cache must not send the renderer past its arrays, it is rebuilt from the source instead
+	const std::size_t counts[3] = { obj.vertices.size(), obj.textureCoords.size(), obj.normals.size() };
+	if (!obj.polygons.AreIndicesInRange(counts) || !Polygons::AreIndicesInRange(obj.polygons.tangentsIndices, obj.tangents.size())) return {};
+
+	for (const auto& meshlet : obj.meshlets)
+	{
+		if (meshlet.firstPolygon < 0 || meshlet.polygonsCount < 0 || (std::uint64_t)meshlet.firstPolygon + meshlet.polygonsCount > polygonsCount) return {};
+	}
+
+	return obj;
+}
+
+void MeshCache::Write(const std::string& sourcePath, const CacheKey& key, const Obj& obj)
+{
+	struct SectionData
+	{
+		const void* data;
+		std::uint64_t count;
+		std::uint64_t elementSize;
+	};
+
+	const SectionData sections[SectionsCount] =
+	{
+		{ obj.vertices.data(), obj.vertices.size(), sizeof(obj.vertices[0]) },
+		{ obj.textureCoords.data(), obj.textureCoords.size(), sizeof(obj.textureCoords[0]) },
+		{ obj.normals.data(), obj.normals.size(), sizeof(obj.normals[0]) },
+		{ obj.tangents.data(), obj.tangents.size(), sizeof(obj.tangents[0]) },
+		{ obj.polygons.verticesIndices.data(), obj.polygons.size(), sizeof(obj.polygons.verticesIndices[0]) },
+		{ obj.polygons.textureIndices.data(), obj.polygons.size(), sizeof(obj.polygons.textureIndices[0]) },
+		{ obj.polygons.normalsIndices.data(), obj.polygons.size(), sizeof(obj.polygons.normalsIndices[0]) },
+		{ obj.polygons.tangentsIndices.data(), obj.polygons.size(), sizeof(obj.polygons.tangentsIndices[0]) },
+		{ obj.meshlets.data(), obj.meshlets.size(), sizeof(obj.meshlets[0]) }
+	};
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	header.key = key;
+
+	std::uint64_t offset = sizeof(Header) + key.pathLength;
+	for (int i = 0; i < SectionsCount; i++)
+	{
+		offset = (offset + MeshCacheAlignment - 1) / MeshCacheAlignment * MeshCacheAlignment;
+		header.counts[i] = sections[i].count;
+		header.offsets[i] = offset;
+		offset += sections[i].count * sections[i].elementSize;
+	}
+
+	glm::vec3 boundsMin(obj.vertices.empty() ? 0.0f : std::numeric_limits<float>::max());
+	glm::vec3 boundsMax(obj.vertices.empty() ? 0.0f : std::numeric_limits<float>::lowest());
+	for (const auto& vertex : obj.vertices)
+	{
+		boundsMin = glm::min(boundsMin, glm::vec3(vertex));
+		boundsMax = glm::max(boundsMax, glm::vec3(vertex));
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		header.boundsMin[i] = boundsMin[i];
+		header.boundsMax[i] = boundsMax[i];
+	}
+
+	CacheFile::Write(sourcePath, header, [&](std::ofstream& file)
+	{
+		const char padding[MeshCacheAlignment] = {};
+		std::uint64_t position = sizeof(Header) + key.pathLength;
+
+		for (int i = 0; i < SectionsCount; i++)
+		{
+			file.write(padding, header.offsets[i] - position);
+			file.write(static_cast<const char*>(sections[i].data), (std::streamsize)(sections[i].count * sections[i].elementSize));
+			position = header.offsets[i] + sections[i].count * sections[i].elementSize;
+		}
+	});
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "Obj.h"
+#include "CacheFile.h"
+#include "MappedFile.h"
+
+namespace cga
+{
+
+// Bumped whenever the header, the sections or the structures stored in them change
+const std::uint32_t MeshCacheVersion = 4;
+
+// Every section starts at a multiple of this in the cache file
+const std::uint32_t MeshCacheAlignment = 64;
+
+// Loads OBJ meshes through a binary cache stored next to them, see CacheFile. The cache holds the parsed and
+// built mesh: positions, texture coordinates, normals, tangents, the flat index buffers and the meshlets,
+// so a warm load is a few bulk copies out of the mapped file.
+class MeshCache
+{
+public:
+	std::optional<Obj> Load(const std::string& sourcePath);
+
+	// Model space bounds of the positions, from the cache header when it is current and from a positions only pass otherwise
+	bool LoadBounds(const std::string& sourcePath, glm::vec3& boundsMin, glm::vec3& boundsMax);
+
+protected:
+	enum Section
+	{
+		SectionVertices,
+		SectionTextureCoords,
+		SectionNormals,
+		SectionTangents,
+		SectionVerticesIndices,
+		SectionTextureIndices,
+		SectionNormalsIndices,
+		SectionTangentsIndices,
+		SectionMeshlets,
+		SectionsCount
+	};
+
+	struct Header
+	{
+		CacheKey key;
+		// Element counts and file offsets per section
+		std::uint64_t counts[SectionsCount];
+		std::uint64_t offsets[SectionsCount];
+		// Model space bounds of the positions
+		float boundsMin[3];
+		float boundsMax[3];
+	};
+
+	// Empty when there is no current cache or its contents are out of range
+	std::optional<Obj> Map(const std::string& sourcePath, const CacheKey& key);
+	void Write(const std::string& sourcePath, const CacheKey& key, const Obj& obj);
+
+	template <typename T>
+	static inline bool ReadSection(const MappedFile& file, const Header& header, Section section, std::vector<T>& target)
+	{
+		const std::uint64_t offset = header.offsets[section];
+		const std::uint64_t count = header.counts[section];
+		if (offset % MeshCacheAlignment != 0 || offset > file.GetSize() || count > (file.GetSize() - offset) / sizeof(T)) return false;
+
+		const T* data = reinterpret_cast<const T*>(file.GetData() + offset);
+		target.assign(data, data + count);
+		return true;
+	}
+};
+
+}
@@ -0,0 +1,213 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace cga
+{
+
+void MeshOptimizer::Optimize(Obj& obj)
+{
+	auto& polygons = obj.polygons;
+
+	// Exporters often write the same position once per face, the renderer transforms each only once.
+	// Normals are not welded: tangents are built per normal, and equal normals of unrelated polygons,
+	// like the ones around the pole of a sphere, would share one tangent and shade differently.
+	Remap(polygons.verticesIndices, Weld(obj.vertices));
+	Remap(polygons.textureIndices, Weld(obj.textureCoords));
+
+	polygons.Reorder(GetCacheOrder(polygons, (int)obj.vertices.size()));
+
+	// Consecutive polygons now read neighbouring elements of the vertex streams
+	ReorderByFirstUse(obj.vertices, polygons.verticesIndices);
+	ReorderByFirstUse(obj.textureCoords, polygons.textureIndices);
+	ReorderByFirstUse(obj.normals, polygons.normalsIndices);
+}
+
+void MeshOptimizer::SortMeshlets(Obj& obj)
+{
+	auto& meshlets = obj.meshlets;
+	if (meshlets.size() < 2) return;
+
+	glm::vec3 centroid(0.0f);
+	int polygonsCount = 0;
+	for (const auto& meshlet : meshlets)
+	{
+		centroid += meshlet.center * (float)meshlet.polygonsCount;
+		polygonsCount += meshlet.polygonsCount;
+	}
+	centroid /= (float)std::max(polygonsCount, 1);
+
+	// How far a meshlet faces out of the mesh, meshlets without a normal cone get 0
+	std::vector<float> keys(meshlets.size());
+	for (size_t i = 0; i < meshlets.size(); i++)
+	{
+		keys[i] = glm::dot(meshlets[i].center - centroid, meshlets[i].coneAxis);
+	}
+
+	std::vector<int> meshletOrder(meshlets.size());
+	std::iota(meshletOrder.begin(), meshletOrder.end(), 0);
+	std::stable_sort(meshletOrder.begin(), meshletOrder.end(), [&](int a, int b) { return keys[a] > keys[b]; });
+
+	std::vector<Meshlet> sorted;
+	sorted.reserve(meshlets.size());
+	std::vector<int> polygonOrder;
+	polygonOrder.reserve(obj.polygons.size());
+
+	for (int i : meshletOrder)
+	{
+		Meshlet meshlet = meshlets[i];
+		const int first = meshlet.firstPolygon;
+		meshlet.firstPolygon = (int)polygonOrder.size();
+		for (int k = 0; k < meshlet.polygonsCount; k++) polygonOrder.push_back(first + k);
+		sorted.push_back(meshlet);
+	}
+
+	obj.polygons.Reorder(polygonOrder);
+	meshlets = std::move(sorted);
+}
+
+template <typename T>
+std::vector<int> MeshOptimizer::Weld(std::vector<T>& values)
+{
+	// Bitwise comparison, which gives a strict order for any float and keeps -0 and 0 apart
+	auto less = [&](int a, int b) { return std::memcmp(&values[a], &values[b], sizeof(T)) < 0; };
+
+	std::vector<int> order(values.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), less);
+
+	std::vector<int> remap(values.size());
+	std::vector<T> welded;
+	welded.reserve(values.size());
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		if (i == 0 || less(order[i - 1], order[i])) welded.push_back(values[order[i]]);
+		remap[order[i]] = (int)welded.size() - 1;
+	}
+
+	values = std::move(welded);
+	return remap;
+}
+
+template <typename T>
+void MeshOptimizer::ReorderByFirstUse(std::vector<T>& values, std::vector<glm::ivec3>& indices)
+{
+	std::vector<int> remap(values.size(), -1);
+	std::vector<T> reordered;
+	reordered.reserve(values.size());
+
+	for (auto& polygon : indices)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			int& index = remap[polygon[k]];
+			if (index == -1)
+			{
+				index = (int)reordered.size();
+				reordered.push_back(values[polygon[k]]);
+			}
+			polygon[k] = index;
+		}
+	}
+
+	values = std::move(reordered);
+}
+
+// Tipsify, Sander et al. 2007: fans around one vertex at a time and moves on to a neighbour that is still
+// in the cache and has polygons left, or to the most recent dead end, so it runs in linear time
+std::vector<int> MeshOptimizer::GetCacheOrder(const Polygons& polygons, int verticesCount)
+{
+	const int polygonsCount = (int)polygons.size();
+	const auto& indices = polygons.verticesIndices;
+
+	const VertexAdjacency adjacency(polygons, verticesCount);
+	const auto& offsets = adjacency.offsets;
+
+	// Polygons left per vertex, time each vertex entered the cache and the emitted polygons
+	std::vector<int> live(verticesCount);
+	for (int i = 0; i < verticesCount; i++) live[i] = offsets[i + 1] - offsets[i];
+	std::vector<int> cacheTime(verticesCount, 0);
+	std::vector<char> emitted(polygonsCount, 0);
+
+	std::vector<int> order;
+	order.reserve(polygonsCount);
+	std::vector<int> deadEnds;
+	std::vector<int> candidates;
+
+	int time = VertexCacheSize + 1;
+	int cursor = 0;
+	int fan = verticesCount > 0 ? 0 : -1;
+
+	while (fan >= 0)
+	{
+		candidates.clear();
+
+		for (int j = offsets[fan]; j < offsets[fan + 1]; j++)
+		{
+			const int polygon = adjacency.polygons[j];
+			if (emitted[polygon]) continue;
+
+			for (int k = 0; k < 3; k++)
+			{
+				const int vertex = indices[polygon][k];
+				deadEnds.push_back(vertex);
+				candidates.push_back(vertex);
+				live[vertex]--;
+
+				if (time - cacheTime[vertex] > VertexCacheSize)
+				{
+					cacheTime[vertex] = time;
+					time++;
+				}
+			}
+
+			emitted[polygon] = 1;
+			order.push_back(polygon);
+		}
+
+		// Prefer the candidate that entered the cache first but will still be in it after its remaining polygons
+		fan = -1;
+		int bestPriority = -1;
+		for (int vertex : candidates)
+		{
+			if (live[vertex] <= 0) continue;
+
+			int priority = 0;
+			if (time - cacheTime[vertex] + 2 * live[vertex] <= VertexCacheSize) priority = time - cacheTime[vertex];
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				fan = vertex;
+			}
+		}
+
+		if (fan != -1) continue;
+
+		while (!deadEnds.empty() && fan == -1)
+		{
+			const int vertex = deadEnds.back();
+			deadEnds.pop_back();
+			if (live[vertex] > 0) fan = vertex;
+		}
+
+		for (; fan == -1 && cursor < verticesCount; cursor++)
+		{
+			if (live[cursor] > 0) fan = cursor;
+		}
+	}
+
+	return order;
+}
+
+void MeshOptimizer::Remap(std::vector<glm::ivec3>& indices, const std::vector<int>& remap)
+{
+	for (auto& polygon : indices)
+	{
+		for (int k = 0; k < 3; k++) polygon[k] = remap[polygon[k]];
+	}
+}
+
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+
+#include "Obj.h"
+
+namespace cga
+{
+
+// Vertices the cache ordering assumes stay close at hand, in the spirit of a post-transform cache
+const int VertexCacheSize = 16;
+
+// Load time mesh optimization.
+// Optimize welds duplicate positions and texture coordinates, orders polygons for vertex locality (Tipsify) and renumbers the
+// attributes in the order the polygons first use them. SortMeshlets orders meshlets so that the ones facing
+// outwards come first, which draws nearer surfaces first from most views and cuts overdraw.
+// Attributes keep their own index buffers: the renderer transforms every position and normal once per frame
+// into streams the polygons index, so welding positions is what saves transforms.
+class MeshOptimizer
+{
+public:
+	void Optimize(Obj& obj);
+
+	// Needs the meshlets with their bounds, see MeshletBuilder
+	void SortMeshlets(Obj& obj);
+
+protected:
+	// Sorts the values, drops duplicates and returns the new index of every old one
+	template <typename T>
+	std::vector<int> Weld(std::vector<T>& values);
+
+	// Keeps only the values the indices use, in the order of their first use, and rewrites the indices
+	template <typename T>
+	void ReorderByFirstUse(std::vector<T>& values, std::vector<glm::ivec3>& indices);
+
+	std::vector<int> GetCacheOrder(const Polygons& polygons, int verticesCount);
+
+	static void Remap(std::vector<glm::ivec3>& indices, const std::vector<int>& remap);
+};
+
+}
@@ -0,0 +1,127 @@
+#include "MeshletBuilder.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace cga
+{
+
+void MeshletBuilder::Build(Obj& obj)
+{
+	auto& polygons = obj.polygons;
+	const int polygonsCount = (int)polygons.size();
+	const VertexAdjacency adjacency(polygons, (int)obj.vertices.size());
+
+	// Grow every meshlet breadth first from the first unassigned polygon, so it stays compact
+	std::vector<int> order;
+	order.reserve(polygonsCount);
+	std::vector<int> queuedIn(polygonsCount, -1);
+	std::vector<int> queue;
+
+	obj.meshlets.clear();
+
+	for (int seed = 0; seed < polygonsCount; seed++)
+	{
+		if (queuedIn[seed] != -1) continue;
+
+		const int meshletIndex = (int)obj.meshlets.size();
+		Meshlet meshlet;
+		meshlet.firstPolygon = (int)order.size();
+		meshlet.polygonsCount = 0;
+
+		queue.clear();
+		queue.push_back(seed);
+		queuedIn[seed] = meshletIndex;
+
+		for (size_t head = 0; head < queue.size() && meshlet.polygonsCount < MeshletSize; head++)
+		{
+			const int polygon = queue[head];
+			order.push_back(polygon);
+			meshlet.polygonsCount++;
+
+			for (int k = 0; k < 3; k++)
+			{
+				const int vertex = polygons.verticesIndices[polygon][k];
+				for (int j = adjacency.offsets[vertex]; j < adjacency.offsets[vertex + 1]; j++)
+				{
+					const int neighbour = adjacency.polygons[j];
+					if (queuedIn[neighbour] != -1) continue;
+
+					queuedIn[neighbour] = meshletIndex;
+					queue.push_back(neighbour);
+				}
+			}
+		}
+
+		// Queued polygons which didn't fit go back to the pool
+		for (size_t i = meshlet.polygonsCount; i < queue.size(); i++)
+		{
+			queuedIn[queue[i]] = -1;
+		}
+
+		obj.meshlets.push_back(meshlet);
+	}
+
+	polygons.Reorder(order);
+
+	for (auto& meshlet : obj.meshlets)
+	{
+		CalculateBounds(obj, meshlet);
+	}
+}
+
+void MeshletBuilder::CalculateBounds(const Obj& obj, Meshlet& meshlet)
+{
+	const auto& polygons = obj.polygons;
+	const int first = meshlet.firstPolygon;
+	const int last = meshlet.firstPolygon + meshlet.polygonsCount;
+
+	// Bounding sphere around the centroid of the corners
+	glm::vec3 center(0.0f);
+	for (int i = first; i < last; i++)
+	{
+		for (int k = 0; k < 3; k++) center += glm::vec3(obj.vertices[polygons.verticesIndices[i][k]]);
+	}
+	center /= (float)(meshlet.polygonsCount * 3);
+
+	float radius = 0;
+	for (int i = first; i < last; i++)
+	{
+		for (int k = 0; k < 3; k++) radius = std::max(radius, glm::length(glm::vec3(obj.vertices[polygons.verticesIndices[i][k]]) - center));
+	}
+
+	// Normal cone from the face normals, counter-clockwise polygons are front facing
+	std::vector<glm::vec3> faceNormals;
+	faceNormals.reserve(meshlet.polygonsCount);
+	glm::vec3 axis(0.0f);
+	for (int i = first; i < last; i++)
+	{
+		const glm::vec3 a = obj.vertices[polygons.verticesIndices[i][0]];
+		const glm::vec3 b = obj.vertices[polygons.verticesIndices[i][1]];
+		const glm::vec3 c = obj.vertices[polygons.verticesIndices[i][2]];
+		const glm::vec3 normal = glm::cross(b - a, c - a);
+		const float length = glm::length(normal);
+		if (length == 0) continue;
+
+		faceNormals.push_back(normal / length);
+		axis += faceNormals.back();
+	}
+
+	float minDot = -1;
+	const float axisLength = glm::length(axis);
+	if (axisLength > 0)
+	{
+		axis /= axisLength;
+		minDot = 1;
+		for (const auto& normal : faceNormals) minDot = std::min(minDot, glm::dot(axis, normal));
+	}
+
+	meshlet.center = center;
+	meshlet.radius = radius;
+	meshlet.coneAxis = axis;
+
+	// Normals spread over more than a hemisphere leave nothing to cull
+	meshlet.coneCutoff = minDot <= 0 ? 1.0f : std::sqrt(1.0f - minDot * minDot);
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Obj.h"
+
+namespace cga
+{
+
+const int MeshletSize = 64;
+
+// Splits a mesh into meshlets of up to MeshletSize connected polygons.
+// Polygons are reordered so that every meshlet is a consecutive range.
+class MeshletBuilder
+{
+public:
+	void Build(Obj& obj);
+
+protected:
+	void CalculateBounds(const Obj& obj, Meshlet& meshlet);
+};
+
+}
@@ -1,18 +1,120 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <cstddef>
+#include <utility>
 #include <vector>
-#include <windows.h>
 
 namespace cga 
 {
 
-class Polygon
+// Triangle list stored as one index buffer per attribute, three indices per triangle.
+// Passes that only need positions never touch the texture and normal indices.
+class Polygons
 {
 public:
-	std::vector<int> verticesIndices;
-	std::vector<int> textureIndices;
-	std::vector<int> normalsIndices;
+	std::vector<glm::ivec3> verticesIndices;
+	std::vector<glm::ivec3> textureIndices;
+	std::vector<glm::ivec3> normalsIndices;
+
+	// Filled by TangentBuilder, empty before
+	std::vector<glm::ivec3> tangentsIndices;
+
+	inline size_t size() const
+	{
+		return verticesIndices.size();
+	}
+
+	inline void reserve(size_t count)
+	{
+		verticesIndices.reserve(count);
+		textureIndices.reserve(count);
+		normalsIndices.reserve(count);
+	}
+
+	inline void push_back(const glm::ivec3& vertices, const glm::ivec3& texture, const glm::ivec3& normals)
+	{
+		verticesIndices.push_back(vertices);
+		textureIndices.push_back(texture);
+		normalsIndices.push_back(normals);
+	}
+
+	// Every index of the positions, texture coordinates and normals is at least 0 and below the count of its attribute
+	inline bool AreIndicesInRange(const std::size_t counts[3]) const
+	{
+		return AreIndicesInRange(verticesIndices, counts[0]) && AreIndicesInRange(textureIndices, counts[1]) && AreIndicesInRange(normalsIndices, counts[2]);
+	}
+
+	static inline bool AreIndicesInRange(const std::vector<glm::ivec3>& indices, std::size_t count)
+	{
+		for (const auto& polygon : indices)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				if (polygon[k] < 0 || (std::size_t)polygon[k] >= count) return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Polygon i of the result is polygon order[i]
+	inline void Reorder(const std::vector<int>& order)
+	{
+		Reorder(verticesIndices, order);
+		Reorder(textureIndices, order);
+		Reorder(normalsIndices, order);
+		if (!tangentsIndices.empty()) Reorder(tangentsIndices, order);
+	}
+
+	static inline void Reorder(std::vector<glm::ivec3>& indices, const std::vector<int>& order)
+	{
+		std::vector<glm::ivec3> reordered;
+		reordered.reserve(order.size());
+		for (int i : order) reordered.push_back(indices[i]);
+		indices = std::move(reordered);
+	}
+};
+
+// Polygons using each vertex, as offsets into one array: the ones of vertex i are
+// polygons[offsets[i]] up to polygons[offsets[i + 1]], in increasing order
+class VertexAdjacency
+{
+public:
+	std::vector<int> offsets;
+	std::vector<int> polygons;
+
+	VertexAdjacency(const Polygons& aPolygons, int verticesCount)
+		: offsets(verticesCount + 1, 0)
+	{
+		const auto& indices = aPolygons.verticesIndices;
+		const int polygonsCount = (int)aPolygons.size();
+
+		for (int i = 0; i < polygonsCount; i++)
+		{
+			for (int k = 0; k < 3; k++) offsets[indices[i][k] + 1]++;
+		}
+		for (int i = 0; i < verticesCount; i++) offsets[i + 1] += offsets[i];
+
+		polygons.resize(offsets[verticesCount]);
+		std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+		for (int i = 0; i < polygonsCount; i++)
+		{
+			for (int k = 0; k < 3; k++) polygons[fill[indices[i][k]]++] = i;
+		}
+	}
+};
+
+// Cluster of consecutive polygons, bounds are in model space.
+// All polygon normals are within the cone around coneAxis, a cone cutoff of 1 means it can't be backface culled.
+struct Meshlet
+{
+	int firstPolygon;
+	int polygonsCount;
+	glm::vec3 center;
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff;
 };
 
 class Obj
@@ -21,7 +123,12 @@ public:
 	std::vector<glm::vec4> vertices;
 	std::vector<glm::vec3> textureCoords;
 	std::vector<glm::vec3> normals;
-	std::vector<Polygon> polygons;
+
+	// Indexed by Polygons::tangentsIndices: xyz is the direction of increasing u, w the handedness of the bitangent
+	std::vector<glm::vec4> tangents;
+
+	Polygons polygons;
+	std::vector<Meshlet> meshlets;
 };
 
 }
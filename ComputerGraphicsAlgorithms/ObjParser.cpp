@@ -1,44 +1,225 @@
 #include "ObjParser.h"
+#include "MappedFile.h"
+#include "ParallelFor.h"
 
-#include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <thread>
 
 namespace cga
 {
 
+ObjParser::ObjParser()
+	: threadPool((std::max)(std::thread::hardware_concurrency(), 1u))
+{
+}
+
 std::optional<Obj> ObjParser::Parse(std::string fileName)
 {
-	std::ifstream targetFile(fileName);
-	if (targetFile.is_open())
+	MappedFile file;
+	if (file.Open(fileName))
 	{
+		const char* text = reinterpret_cast<const char*>(file.GetData());
+		std::vector<Chunk> chunks = Split(text, text + file.GetSize());
+
+		ParallelFor(threadPool, 0, (int)chunks.size(), 1, [&](int, int, int first, int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				chunks[i].parsed = ParseText(chunks[i]);
+			}
+		}).Wait();
+
+		for (const auto& chunk : chunks)
+		{
+			if (!chunk.parsed) return {};
+		}
+
 		Obj obj;
-		std::string line;
+		if (!Merge(chunks, obj)) return {};
+
+		return obj;
+	}
+
+	return {};
+}
+
+bool ObjParser::ParseBounds(std::string fileName, glm::vec3& boundsMin, glm::vec3& boundsMax)
+{
+	MappedFile file;
+	if (!file.Open(fileName)) return false;
 
-		while (std::getline(targetFile, line))
+	const char* text = reinterpret_cast<const char*>(file.GetData());
+	std::vector<Chunk> chunks = Split(text, text + file.GetSize());
+
+	// Per chunk, min is above max for chunks without positions
+	std::vector<glm::vec3> chunkMin(chunks.size(), glm::vec3(std::numeric_limits<float>::max()));
+	std::vector<glm::vec3> chunkMax(chunks.size(), glm::vec3(std::numeric_limits<float>::lowest()));
+
+	ParallelFor(threadPool, 0, (int)chunks.size(), 1, [&](int, int, int first, int last)
+	{
+		for (int i = first; i < last; i++)
 		{
-			if (line.substr(0, 2) == "v ")
+			chunks[i].parsed = true;
+			for (const char* line = chunks[i].begin; line < chunks[i].end;)
 			{
-				if (!ExtractVertex(obj, line)) return {};
+				const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', chunks[i].end - line));
+				if (lineEnd == nullptr) lineEnd = chunks[i].end;
+
+				glm::vec4 vertex;
+				if (lineEnd - line >= 2 && line[0] == 'v' && IsSpace(line[1]))
+				{
+					if (!ParseVertex(line + 2, lineEnd, vertex))
+					{
+						chunks[i].parsed = false;
+						break;
+					}
+					chunkMin[i] = glm::min(chunkMin[i], glm::vec3(vertex));
+					chunkMax[i] = glm::max(chunkMax[i], glm::vec3(vertex));
+				}
+
+				line = lineEnd + 1;
 			}
-			else if (line.substr(0, 2) == "vt")
+		}
+	}).Wait();
+
+	boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		if (!chunks[i].parsed) return false;
+		boundsMin = glm::min(boundsMin, chunkMin[i]);
+		boundsMax = glm::max(boundsMax, chunkMax[i]);
+	}
+
+	return boundsMin.x <= boundsMax.x;
+}
+
+std::vector<ObjParser::Chunk> ObjParser::Split(const char* begin, const char* end)
+{
+	std::vector<Chunk> chunks;
+	while (begin < end)
+	{
+		const char* chunkEnd = end;
+		if ((std::size_t)(end - begin) > ObjChunkSize)
+		{
+			const char* lineBreak = static_cast<const char*>(std::memchr(begin + ObjChunkSize, '\n', end - begin - ObjChunkSize));
+			if (lineBreak != nullptr) chunkEnd = lineBreak + 1;
+		}
+
+		chunks.emplace_back();
+		chunks.back().begin = begin;
+		chunks.back().end = chunkEnd;
+		begin = chunkEnd;
+	}
+
+	return chunks;
+}
+
+bool ObjParser::ParseText(Chunk& chunk)
+{
+	Obj& targetObj = chunk.obj;
+	const char* end = chunk.end;
+
+	for (const char* line = chunk.begin; line < end;)
+	{
+		const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', end - line));
+		if (lineEnd == nullptr) lineEnd = end;
+
+		// Keyword and the separator after it
+		if (lineEnd - line >= 2)
+		{
+			if (line[0] == 'v' && IsSpace(line[1]))
+			{
+				if (!ExtractVertex(targetObj, line + 2, lineEnd)) return false;
+			}
+			else if (line[0] == 'v' && line[1] == 't')
 			{
-				if (!ExtractTextureCoords(obj, line)) return {};
+				if (!ExtractTextureCoords(targetObj, line + 2, lineEnd)) return false;
 			}
-			else if (line.substr(0, 2) == "vn")
+			else if (line[0] == 'v' && line[1] == 'n')
 			{
-				if (!ExtractNormal(obj, line)) return {};
+				if (!ExtractNormal(targetObj, line + 2, lineEnd)) return false;
 			}
-			else if (line.substr(0, 2) == "f ")
+			else if (line[0] == 'f' && IsSpace(line[1]))
 			{
-				if (!ExtractFace(obj, line)) return {};
+				if (!ExtractFace(targetObj, chunk.relativePolygons, line + 2, lineEnd)) return false;
 			}
-			// TODO: Possibly add check for the same number of values read on each category with overall number (for category) in the file
 		}
 
-		return obj;
+		line = lineEnd + 1;
 	}
 
-	return {};
+	return true;
+}
+
+bool ObjParser::Merge(std::vector<Chunk>& chunks, Obj& targetObj)
+{
+	if (chunks.size() == 1)
+	{
+		targetObj = std::move(chunks[0].obj);
+		const std::size_t counts[3] = { targetObj.vertices.size(), targetObj.textureCoords.size(), targetObj.normals.size() };
+		return targetObj.polygons.AreIndicesInRange(counts);
+	}
+
+	// Exclusive prefix sums of the chunk counts
+	std::size_t totals[4] = {};
+	for (auto& chunk : chunks)
+	{
+		const std::size_t counts[4] = { chunk.obj.vertices.size(), chunk.obj.textureCoords.size(), chunk.obj.normals.size(), chunk.obj.polygons.size() };
+		for (int i = 0; i < 4; i++)
+		{
+			chunk.offsets[i] = totals[i];
+			totals[i] += counts[i];
+		}
+	}
+
+	targetObj.vertices.resize(totals[0]);
+	targetObj.textureCoords.resize(totals[1]);
+	targetObj.normals.resize(totals[2]);
+	targetObj.polygons.verticesIndices.resize(totals[3]);
+	targetObj.polygons.textureIndices.resize(totals[3]);
+	targetObj.polygons.normalsIndices.resize(totals[3]);
+
+	// Forward references may point into later chunks, so indices can only be checked against the totals
+	std::vector<char> inRange(chunks.size(), 0);
+
+	ParallelFor(threadPool, 0, (int)chunks.size(), 1, [&](int, int, int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			Chunk& chunk = chunks[i];
+			Obj& obj = chunk.obj;
+
+			// Relative indices were resolved against the chunk's own counts
+			for (const auto& relative : chunk.relativePolygons)
+			{
+				glm::ivec3* indices[3] = { &obj.polygons.verticesIndices[relative.polygon], &obj.polygons.textureIndices[relative.polygon], &obj.polygons.normalsIndices[relative.polygon] };
+				for (int corner = 0; corner < 3; corner++)
+				{
+					for (int attribute = 0; attribute < 3; attribute++)
+					{
+						if (relative.mask & (1 << (corner * 3 + attribute))) (*indices[attribute])[corner] += (int)chunk.offsets[attribute];
+					}
+				}
+			}
+
+			inRange[i] = obj.polygons.AreIndicesInRange(totals);
+
+			std::copy(obj.vertices.begin(), obj.vertices.end(), targetObj.vertices.begin() + chunk.offsets[0]);
+			std::copy(obj.textureCoords.begin(), obj.textureCoords.end(), targetObj.textureCoords.begin() + chunk.offsets[1]);
+			std::copy(obj.normals.begin(), obj.normals.end(), targetObj.normals.begin() + chunk.offsets[2]);
+			std::copy(obj.polygons.verticesIndices.begin(), obj.polygons.verticesIndices.end(), targetObj.polygons.verticesIndices.begin() + chunk.offsets[3]);
+			std::copy(obj.polygons.textureIndices.begin(), obj.polygons.textureIndices.end(), targetObj.polygons.textureIndices.begin() + chunk.offsets[3]);
+			std::copy(obj.polygons.normalsIndices.begin(), obj.polygons.normalsIndices.end(), targetObj.polygons.normalsIndices.begin() + chunk.offsets[3]);
+
+			// Frees the chunk as soon as it is merged
+			obj = Obj();
+		}
+	}).Wait();
+
+	return std::all_of(inRange.begin(), inRange.end(), [](char chunkInRange) { return chunkInRange != 0; });
 }
 
-}
\ No newline at end of file
+}
@@ -2,128 +2,204 @@
 
 #include <string>
 #include <optional>
-#include <sstream>
-#include <stdio.h>
+#include <charconv>
+#include <cstddef>
+#include <vector>
+
+#include <ctpl/ctpl_stl.h>
 
 #include "Obj.h"
 
 namespace cga
 {
 
+// Files are split into chunks of about this many bytes, ending at line breaks, which are parsed in parallel
+const std::size_t ObjChunkSize = 4 << 20;
+
+// Reads the v, vt, vn and f lines of an OBJ file, everything else is skipped. The file is memory-mapped
+// and scanned in place, numbers are parsed straight from the mapping, so no line is ever copied.
+// The mesh comes out as the file has it, without meshlets or tangents, MeshCache builds those.
 class ObjParser
 {
 public:
+	ObjParser();
+
 	std::optional<Obj> Parse(std::string fileName);
 
+	// Bounds of the positions alone, a fraction of the cost of Parse. False when there are none or a line is malformed.
+	bool ParseBounds(std::string fileName, glm::vec3& boundsMin, glm::vec3& boundsMax);
+
 protected:
-	inline bool ExtractVertex(Obj& targetObj, std::string string)
+	// Triangle with relative face indices, bit corner * 3 + attribute is set for each index that
+	// was resolved against the counts of its chunk and still needs the chunk's offset
+	struct RelativePolygon
 	{
-		std::istringstream vertexStringStream(string.substr(2));
-		glm::vec4 vertex(0, 0, 0, 1);
+		int polygon;
+		int mask;
+	};
 
-		vertexStringStream >> vertex.x;
-		vertexStringStream >> vertex.y;
-		vertexStringStream >> vertex.z;
+	// Lines of one chunk and what they hold. Offsets are where its elements go in the merged mesh.
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		Obj obj;
+		std::vector<RelativePolygon> relativePolygons;
+		bool parsed = false;
+		std::size_t offsets[4];
+	};
 
-		if (!vertexStringStream.eof())
-		{
-			vertexStringStream >> vertex.w;
-		}
+	// Every chunk but the last ends right after a line break
+	std::vector<Chunk> Split(const char* begin, const char* end);
 
-		if (!vertexStringStream.fail() && vertexStringStream.eof())
-		{
-			targetObj.vertices.push_back(vertex);
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+	// Parses the lines of the chunk, false on the first malformed one
+	bool ParseText(Chunk& chunk);
+
+	// Concatenates the chunks and rebases their relative face indices.
+	// False when a face refers to an element the file doesn't have.
+	bool Merge(std::vector<Chunk>& chunks, Obj& targetObj);
+
+	ctpl::thread_pool threadPool;
+
+	static inline bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
 	}
 
-	inline bool ExtractTextureCoords(Obj& targetObj, std::string string)
+	static inline const char* SkipSpaces(const char* position, const char* end)
 	{
-		std::istringstream textureCoordsStringStream(string.substr(2));
-		glm::vec3 textureCords(0, 0, 0);
+		while (position != end && IsSpace(*position)) position++;
+		return position;
+	}
 
-		textureCoordsStringStream >> textureCords.x;
+	static inline bool ParseFloat(const char*& position, const char* end, float& value)
+	{
+		// from_chars takes no explicit plus sign
+		if (position != end && *position == '+') position++;
 
-		if (!textureCoordsStringStream.eof())
-		{
-			textureCoordsStringStream >> textureCords.y;
-		}
+		const auto result = std::from_chars(position, end, value);
+		if (result.ec != std::errc()) return false;
 
-		if (!textureCoordsStringStream.eof())
-		{
-			textureCoordsStringStream >> textureCords.z;
-		}
+		position = result.ptr;
+		return true;
+	}
 
-		if (!textureCoordsStringStream.fail() && textureCoordsStringStream.eof())
-		{
-			targetObj.textureCoords.push_back(textureCords);
-			return true;
-		}
-		else
+	// Values are separated by spaces, a line ends at its end or at a comment
+	static inline bool AtLineEnd(const char* position, const char* end)
+	{
+		return position == end || *position == '#';
+	}
+
+	static inline bool ParseVertex(const char* position, const char* end, glm::vec4& vertex)
+	{
+		vertex = glm::vec4(0, 0, 0, 1);
+
+		for (int i = 0; i < 4; i++)
 		{
-			return false;
+			position = SkipSpaces(position, end);
+			if (i == 3 && AtLineEnd(position, end)) break;
+			if (!ParseFloat(position, end, vertex[i])) return false;
 		}
+
+		return AtLineEnd(SkipSpaces(position, end), end);
 	}
 
-	inline bool ExtractNormal(Obj& targetObj, std::string string)
+	inline bool ExtractVertex(Obj& targetObj, const char* position, const char* end)
 	{
-		std::istringstream normalStringStream(string.substr(2));
-		glm::vec3 normal;
+		glm::vec4 vertex;
+		if (!ParseVertex(position, end, vertex)) return false;
+
+		targetObj.vertices.push_back(vertex);
+		return true;
+	}
 
-		normalStringStream >> normal.x;
-		normalStringStream >> normal.y;
-		normalStringStream >> normal.z;
+	inline bool ExtractTextureCoords(Obj& targetObj, const char* position, const char* end)
+	{
+		glm::vec3 textureCoords(0, 0, 0);
 
-		if (!normalStringStream.fail() && normalStringStream.eof())
+		for (int i = 0; i < 3; i++)
 		{
-			targetObj.normals.push_back(normal);
-			return true;
+			position = SkipSpaces(position, end);
+			if (i != 0 && AtLineEnd(position, end)) break;
+			if (!ParseFloat(position, end, textureCoords[i])) return false;
 		}
-		else
+
+		if (!AtLineEnd(SkipSpaces(position, end), end)) return false;
+
+		targetObj.textureCoords.push_back(textureCoords);
+		return true;
+	}
+
+	inline bool ExtractNormal(Obj& targetObj, const char* position, const char* end)
+	{
+		glm::vec3 normal;
+
+		for (int i = 0; i < 3; i++)
 		{
-			return false;
+			position = SkipSpaces(position, end);
+			if (!ParseFloat(position, end, normal[i])) return false;
 		}
+
+		if (!AtLineEnd(SkipSpaces(position, end), end)) return false;
+
+		targetObj.normals.push_back(normal);
+		return true;
+	}
+
+	// One based index, negative ones count back from the last element read so far. Returns the zero based index.
+	static inline bool ParseIndex(const char*& position, const char* end, int count, int& index, bool& relative)
+	{
+		int value;
+		const auto result = std::from_chars(position, end, value);
+		if (result.ec != std::errc() || value == 0) return false;
+
+		position = result.ptr;
+		relative = value < 0;
+		index = relative ? count + value : value - 1;
+		return true;
 	}
 
-	inline bool ExtractFace(Obj& targetObj, std::string string)
+	// Corners are v/vt/vn triples, polygons are split into a fan around their first corner.
+	// Relative indices are resolved against the counts of the target, which only holds one chunk.
+	inline bool ExtractFace(Obj& targetObj, std::vector<RelativePolygon>& relativePolygons, const char* position, const char* end)
 	{
-		std::istringstream faceStringStream(string.substr(2));
-		Polygon polygon;
-		std::string tuple;
-
-		// TODO: Improve parsing (include '//' cases etc.)
-		while (std::getline(faceStringStream, tuple, ' '))
-		{	
-			int vertexIndex, textureCoordIndex, normalIndex;
-			if (sscanf_s(tuple.c_str(), "%d/%d/%d", &vertexIndex, &textureCoordIndex, &normalIndex) != 3)
+		const int counts[3] = { (int)targetObj.vertices.size(), (int)targetObj.textureCoords.size(), (int)targetObj.normals.size() };
+		glm::ivec3 first(0), previous(0), corner(0);
+		int firstMask = 0, previousMask = 0;
+		int cornersCount = 0;
+
+		for (position = SkipSpaces(position, end); !AtLineEnd(position, end); position = SkipSpaces(position, end))
+		{
+			int mask = 0;
+			for (int i = 0; i < 3; i++)
 			{
-				return false;
+				bool relative;
+				if (i != 0 && (position == end || *position++ != '/')) return false;
+				if (!ParseIndex(position, end, counts[i], corner[i], relative)) return false;
+				mask |= (int)relative << i;
 			}
-			polygon.verticesIndices.push_back(vertexIndex - 1);
-			polygon.textureIndices.push_back(textureCoordIndex - 1);
-			polygon.normalsIndices.push_back(normalIndex - 1);
-		}
+			if (position != end && !IsSpace(*position) && *position != '#') return false;
 
-		for (int i = 0; i < polygon.verticesIndices.size(); i += 3)
-		{
-			Polygon p;
-			int start = (i + 2 < polygon.verticesIndices.size()) ? i : i - 2;
-			for (int j = start; j <= start + 2; j++)
+			if (cornersCount == 0)
 			{
-				p.verticesIndices.push_back(polygon.verticesIndices[j]);
-				p.textureIndices.push_back(polygon.textureIndices[j]);
-				p.normalsIndices.push_back(polygon.normalsIndices[j]);
+				first = corner;
+				firstMask = mask;
 			}
-			targetObj.polygons.push_back(p);
+			else if (cornersCount >= 2)
+			{
+				if (firstMask | previousMask | mask)
+				{
+					relativePolygons.push_back({ (int)targetObj.polygons.size(), firstMask | (previousMask << 3) | (mask << 6) });
+				}
+				targetObj.polygons.push_back(glm::ivec3(first.x, previous.x, corner.x), glm::ivec3(first.y, previous.y, corner.y), glm::ivec3(first.z, previous.z, corner.z));
+			}
+
+			previous = corner;
+			previousMask = mask;
+			cornersCount++;
 		}
 
-		//targetObj.polygons.push_back(polygon);
-			
-		return true;
+		return cornersCount >= 3;
 	}
 };
 
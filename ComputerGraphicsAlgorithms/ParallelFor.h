@@ -0,0 +1,76 @@
+#pragma once
+
+#include <future>
+#include <vector>
+#include <algorithm>
+
+#include <ctpl/ctpl_stl.h>
+
+namespace cga
+{
+
+// Join handle for the tasks started by one ParallelFor call. Waiting rethrows the first exception a task threw.
+class TaskGroup
+{
+public:
+	TaskGroup() = default;
+	TaskGroup(TaskGroup&&) = default;
+	TaskGroup& operator=(TaskGroup&&) = default;
+
+	~TaskGroup()
+	{
+		for (auto& future : futures)
+		{
+			if (future.valid()) future.wait();
+		}
+	}
+
+	inline void Add(std::future<void> future)
+	{
+		futures.push_back(std::move(future));
+	}
+
+	inline void Wait()
+	{
+		for (auto& future : futures)
+		{
+			if (future.valid()) future.get();
+		}
+	}
+
+	// Number of tasks started, task indices passed to the function are below it
+	inline int Size() const
+	{
+		return (int)futures.size();
+	}
+
+private:
+	std::vector<std::future<void>> futures;
+};
+
+// Splits [first, last) into at most one chunk per pool thread, each at least grainSize long, and runs
+// function(threadId, taskIndex, chunkFirst, chunkLast) for every chunk. Chunks are consecutive in task order.
+// Returns right away, the caller joins through the returned TaskGroup.
+template <typename Function>
+TaskGroup ParallelFor(ctpl::thread_pool& pool, int first, int last, int grainSize, Function function)
+{
+	TaskGroup group;
+
+	const int count = last - first;
+	if (count <= 0) return group;
+
+	const int maxTasks = (count + grainSize - 1) / grainSize;
+	const int tasks = std::max(std::min(pool.size(), maxTasks), 1);
+	const int step = (count + tasks - 1) / tasks;
+
+	for (int task = 0; task * step < count; task++)
+	{
+		const int chunkFirst = first + task * step;
+		const int chunkLast = std::min(chunkFirst + step, last);
+		group.Add(pool.push([function, task, chunkFirst, chunkLast](int id) { function(id, task, chunkFirst, chunkLast); }));
+	}
+
+	return group;
+}
+
+}
@@ -2,138 +2,217 @@
 
 #include <thread>
 #include <algorithm> 
+#include <chrono>
+#include <cmath>
+#include <cstring>
 
 #include "Math.h"
 
-#include "lodepng.h"
+#include "TextureCache.h"
 
 namespace cga
 {
 
 int Renderer::width, Renderer::height;
-int Renderer::workingThreads;
-std::mutex Renderer::mutex;
-std::condition_variable Renderer::cv;
-
-std::vector<unsigned char> Renderer::diffuseMap;
-unsigned Renderer::diffuseMapWidth, Renderer::diffuseMapHeight;
-
-std::vector<unsigned char> Renderer::specularMap;
-unsigned Renderer::specularMapWidth, Renderer::specularMapHeight;
-
-std::vector<unsigned char> Renderer::normalMapLoaded;
-std::vector<glm::vec3> Renderer::normalMap;
-unsigned Renderer::normalMapWidth, Renderer::normalMapHeight;
-std::vector<glm::vec3> Renderer::normalMapTransformed;
+int Renderer::tilesX, Renderer::tilesY;
+Renderer::ShadeFragmentsFunction Renderer::shadeFragments = Renderer::IsAvx2Supported() ? Renderer::ShadeFragmentsAvx2 : Renderer::ShadeFragmentsScalar;
+
+Texture Renderer::diffuseMap;
+Texture Renderer::specularMap;
+
+Texture Renderer::normalMap;
+
+Renderer::Frame::Frame(int aWidth, int aHeight, int aTaskCount, BufferLayout aLayout)
+	: width(aWidth),
+	height(aHeight),
+	buffer(aWidth, aHeight, FormatBgra8, aLayout),
+	zBuffer(aWidth, aHeight),
+	visibilityBuffer(aWidth * aHeight),
+	initializedTiles(GetTileCount(aWidth, aHeight)),
+	constants{ LightSource(glm::vec3(0.0f), glm::vec3(0.0f)), FilterTrilinear },
+	tileBins(aTaskCount, TileBins(GetTileCount(aWidth, aHeight))),
+	drawLists(aTaskCount),
+	clippedInputs(aTaskCount),
+	drawOffsets(aTaskCount)
+{
+	hiZBuffer.Resize(aWidth, aHeight, BlockSize, TileSize);
+}
 
 Renderer::Renderer(int aWidth, int aHeight, std::function<void()> aInvalidateCallback)
 	: aInvalidateCallback(aInvalidateCallback),
-	threadCount(std::thread::hardware_concurrency()),
-	threadPool(std::thread::hardware_concurrency()),
-	buffer(aWidth, aHeight, 0),
-	backBuffer(aWidth, aHeight, 0),
+	threadCount((std::max)(std::thread::hardware_concurrency(), 1u)),
+	threadPool((std::max)(std::thread::hardware_concurrency(), 1u)),
+	rasterizationThread(1),
 	lightSource(glm::vec3(1.0f, 2.5f, 1.5f), glm::vec3(1, 1, 1))
 {
-	width = aWidth;
-	height = aHeight;
-	zBuffer = new float[width * height];
-	zBufferInitial = new float[width * height];
+	outputWidth = aWidth;
+	outputHeight = aHeight;
+	SetRenderSize(aWidth, aHeight);
 
-	for (int i = 0; i < width * height; i++) zBufferInitial[i] = (float)1;
+	CreateFrames();
 }
 
 Renderer::~Renderer()
 {
-	delete [] zBuffer;
-	delete [] zBufferInitial;
+	if (pendingFrame != nullptr) pendingFrame->rasterization.wait();
 }
 
 Buffer& Renderer::GetCurrentBuffer()
 {
-	return buffer;
+	return presentedFrame->resolved ? *presentedFrame->output : presentedFrame->buffer;
+}
+
+void Renderer::CreateFrames()
+{
+	// Frames drawn in another layout or at another size need a resolve before they can be presented
+	const bool resolve = bufferLayout != LayoutLinear || outputFormat != FormatBgra8 || dynamicResolution;
+
+	frames.clear();
+	for (int i = 0; i < FramesInFlight; i++)
+	{
+		frames.push_back(std::make_unique<Frame>(outputWidth, outputHeight, threadCount, bufferLayout));
+		if (resolve) frames.back()->output = std::make_unique<Buffer>(outputWidth, outputHeight, outputFormat, LayoutLinear);
+	}
+	nextFrame = 0;
+	presentedFrame = frames.back().get();
+}
+
+void Renderer::SetRenderSize(int aWidth, int aHeight)
+{
+	width = aWidth;
+	height = aHeight;
+
+	tilesX = (width + TileSize - 1) / TileSize;
+	tilesY = (height + TileSize - 1) / TileSize;
+}
+
+// Rasterization and shading cost follows the pixel count, the square of the scale. The scale drops
+// as far as needed right away, but grows one step at a time and only with headroom, so it doesn't oscillate.
+void Renderer::UpdateResolutionScale(double rasterizationTime)
+{
+	if (rasterizationTime <= 0) return;
+
+	const float target = resolutionScale * (float)std::sqrt(frameBudget / rasterizationTime);
+
+	float scale = resolutionScale;
+	if (rasterizationTime > frameBudget) scale = std::floor(target / ResolutionScaleStep) * ResolutionScaleStep;
+	else if (target > resolutionScale + 2 * ResolutionScaleStep) scale = resolutionScale + ResolutionScaleStep;
+
+	resolutionScale = std::clamp(scale, MinResolutionScale, 1.0f);
+}
+
+void Renderer::ApplyResolutionScale()
+{
+	const int renderWidth = std::max((int)(outputWidth * resolutionScale + 0.5f), 1);
+	const int renderHeight = std::max((int)(outputHeight * resolutionScale + 0.5f), 1);
+	if (renderWidth == width && renderHeight == height) return;
+
+	// Every stage reads the render size, so the frame in flight has to finish first
+	Flush();
+	SetRenderSize(renderWidth, renderHeight);
 }
 
 void Renderer::Render(std::unique_ptr<Scene> &scene)
 {
-	renderTarget = scene->obj;
-	cameraSpaceVertices = renderTarget.vertices;
-	Camera &camera = scene->camera;
+	// The ring is one frame longer than the pipeline, so this one is neither rasterizing nor presented
+	Frame& frame = *frames[nextFrame];
+	nextFrame = (nextFrame + 1) % FramesInFlight;
+
+	if (dynamicResolution) ApplyResolutionScale();
+
+	// Runs on the pool alongside the rasterization of the pending frame
+	ProcessGeometry(frame, *scene);
+
+	Flush();
+
+	frame.rasterization = rasterizationThread.push([this, &frame](int) { Rasterize(frame); });
+	pendingFrame = &frame;
+}
+
+void Renderer::Flush()
+{
+	if (pendingFrame == nullptr) return;
+
+	pendingFrame->rasterization.get();
+	if (dynamicResolution) UpdateResolutionScale(pendingFrame->rasterizationTime);
+
+	presentedFrame = pendingFrame;
+	pendingFrame = nullptr;
+
+	aInvalidateCallback();
+}
+
+void Renderer::ProcessGeometry(Frame& frame, Scene& scene)
+{
+	const Obj& obj = scene.obj;
+	frame.obj = &obj;
+
+	// The hierarchy reads the z-buffer with the row length of the render size
+	if (frame.width != width || frame.height != height)
+	{
+		frame.width = width;
+		frame.height = height;
+		frame.hiZBuffer.Resize(width, height, BlockSize, TileSize);
+	}
+	frame.deferredShading = deferredShading;
+	frame.depthFormat = depthFormat;
+	frame.screenVertices.resize(obj.vertices.size());
+	frame.cameraSpaceVertices.resize(obj.vertices.size());
+	frame.cameraSpaceNormals.resize(obj.normals.size());
+	frame.cameraSpaceTangents.resize(obj.tangents.size());
+	frame.vertexOutcodes.resize(obj.vertices.size());
+	Camera &camera = scene.camera;
 	LightSource lightSource = this->lightSource;
 
 	const auto model = glm::mat4(1.0f);
 	const auto view = camera.GetViewMatrix();
-	const auto projection = GetPerspectiveProjectionMatrix(width, height, 0.1f, 1000.0f, camera.FOV);
-	const auto viewPort = GetViewPortMatrix(width, height);
+	// Reversed depth negates screen space z, so that smaller depth keys are nearer with both projections
+	const bool reversedDepth = IsReversed(frame.depthFormat);
+	const auto projection = reversedDepth
+		? GetReversedPerspectiveProjectionMatrix(width, height, 0.1f, 1000.0f, camera.FOV)
+		: GetPerspectiveProjectionMatrix(width, height, 0.1f, 1000.0f, camera.FOV);
+	const auto viewPort = GetViewPortMatrix(width, height) * GetScaleMatrix(glm::vec3(1.0f, 1.0f, reversedDepth ? -1.0f : 1.0f));
 
 	const auto vm = view * model;
 	const auto pvm = projection * vm;
 	const glm::mat3 TIvm = glm::transpose(glm::inverse(vm));
 
 	lightSource.position = vm * glm::vec4(lightSource.position, 1.0f);
+	frame.constants.lightSource = lightSource;
+	frame.constants.textureFilter = textureFilter;
 
-	int step;
-	int tasksToStart;
+	// Meshlets outside the frustum or facing away are skipped by everything after vertex processing
+	const auto& meshlets = obj.meshlets;
+	frame.meshletVisibility.resize(meshlets.size());
 
-	// Vertices
+	auto cullMeshlets = ParallelFor(threadPool, 0, (int)meshlets.size(), MeshletGrainSize, [&](int, int, int first, int last)
 	{
-		step = (std::max)(renderTarget.vertices.size() / threadCount, renderTarget.vertices.size());
-		workingThreads = step == renderTarget.vertices.size() ? 1 : threadCount;
-		tasksToStart = workingThreads;
-
-		for (int i = 0; i < tasksToStart; i++)
-		{
-			threadPool.push(CalculateVertices
-				, std::ref<Obj>(renderTarget)
-				, std::ref<std::vector<glm::vec4>>(cameraSpaceVertices)
-				, i * step
-				, i == (tasksToStart - 1) ? renderTarget.vertices.size() : (i + 1) * step
-				, std::ref<const glm::mat4>(pvm)
-				, std::ref<const glm::mat4>(vm)
-				, std::ref<const glm::mat4>(viewPort));
-		}
-
-		// Some stuff until waiting
-		backBuffer.ClearWithColor(RGB(50, 200, 50));
-		ClearZBuffer();
-
-		WaitForThreads();
-	}
+		CullMeshlets(meshlets, frame.meshletVisibility, first, last, vm, projection);
+	});
 
-	// Normals
+	// Vertices, normals and tangents are independent of each other
+	auto vertices = ParallelFor(threadPool, 0, (int)obj.vertices.size(), VertexGrainSize, [&](int, int, int first, int last)
 	{
-		step = (std::max)(renderTarget.normals.size() / threadCount, renderTarget.normals.size());
-		workingThreads = step == renderTarget.normals.size() ? 1 : threadCount;
-		tasksToStart = workingThreads;
+		CalculateVertices(obj, frame.screenVertices, frame.cameraSpaceVertices, frame.vertexOutcodes, first, last, pvm, vm, viewPort, reversedDepth);
+	});
 
-		for (int i = 0; i < tasksToStart; i++)
-		{
-			threadPool.push(CalculateNormals
-				, std::ref<Obj>(renderTarget)
-				, i * step
-				, i == (tasksToStart - 1) ? renderTarget.normals.size() : (i + 1) * step
-				, std::ref<const glm::mat3>(TIvm));
-		}
-
-		WaitForThreads();
-	}
+	auto normals = ParallelFor(threadPool, 0, (int)obj.normals.size(), VertexGrainSize, [&](int, int, int first, int last)
+	{
+		CalculateNormals(obj, frame.cameraSpaceNormals, first, last, TIvm);
+	});
 
-	// Normals
+	auto tangents = ParallelFor(threadPool, 0, (int)obj.tangents.size(), VertexGrainSize, [&](int, int, int first, int last)
 	{
-		step = (std::max)(normalMap.size() / threadCount, normalMap.size());
-		workingThreads = step == normalMap.size() ? 1 : threadCount;
-		tasksToStart = workingThreads;
+		CalculateTangents(obj, frame.cameraSpaceTangents, first, last, glm::mat3(vm));
+	});
 
-		for (int i = 0; i < tasksToStart; i++)
-		{
-			threadPool.push(CalculateNormalsMap
-				, std::ref<Obj>(renderTarget)
-				, i * step
-				, i == (tasksToStart - 1) ? normalMap.size() : (i + 1) * step
-				, std::ref<const glm::mat3>(TIvm));
-		}
+	// Logical clear, the buffers themselves are initialized per tile while rasterizing
+	std::fill(frame.initializedTiles.begin(), frame.initializedTiles.end(), 0);
 
-		WaitForThreads();
-	}
+	cullMeshlets.Wait();
+	vertices.Wait();
+	normals.Wait();
+	tangents.Wait();
 
 	// Calculate lighting for polygons and discard by facing
 	//{
@@ -154,97 +233,252 @@ void Renderer::Render(std::unique_ptr<Scene> &scene)
 	//	WaitForThreads();
 	//}
 
-	DrawPolygons(std::ref<Buffer>(backBuffer)
-		, zBuffer
-		, std::ref<Obj>(renderTarget)
-		, std::ref<std::vector<glm::vec4>>(cameraSpaceVertices)
-		, lightSource
-		, 0
-		, renderTarget.polygons.size());
+	// Triangle setup: cull, clip and set up polygons of visible meshlets, then sort the draw list into screen tiles
+	auto setupPolygons = ParallelFor(threadPool, 0, (int)meshlets.size(), MeshletGrainSize, [&](int, int task, int first, int last)
+	{
+		SetupPolygons(obj, frame.screenVertices, frame.cameraSpaceVertices, frame.cameraSpaceNormals, frame.cameraSpaceTangents, frame.vertexOutcodes
+			, projection, viewPort, reversedDepth, frame.meshletVisibility
+			, frame.tileBins[task], frame.drawLists[task], frame.clippedInputs[task], first, last);
+	});
+
+	for (int i = setupPolygons.Size(); i < threadCount; i++)
+	{
+		for (auto& bin : frame.tileBins[i]) bin.clear();
+		frame.drawLists[i].clear();
+		frame.clippedInputs[i].clear();
+	}
 
-	std::swap(buffer.data, backBuffer.data);
+	setupPolygons.Wait();
 
-	aInvalidateCallback();
+	for (int i = 0, offset = 0; i < threadCount; i++)
+	{
+		frame.drawOffsets[i] = offset;
+		offset += (int)frame.drawLists[i].size();
+	}
+}
+
+template <bool Deferred>
+auto Renderer::GetDrawTiles(DepthFormat format)
+{
+	switch (format)
+	{
+	case DepthUnorm16: return DrawTiles<Deferred, DepthUnorm16>;
+	case DepthUnorm24: return DrawTiles<Deferred, DepthUnorm24>;
+	case DepthReversedFloat32: return DrawTiles<Deferred, DepthReversedFloat32>;
+	default: return DrawTiles<Deferred, DepthFloat32>;
+	}
+}
+
+void Renderer::Rasterize(Frame& frame)
+{
+	using Clock = std::chrono::steady_clock;
+
+	const Obj& obj = *frame.obj;
+	std::vector<double> busyTime(threadCount, 0.0);
+
+	// Rasterize tiles concurrently, every tile owns its part of the frame buffer and z-buffer.
+	// One task per thread, tasks pick tiles dynamically.
+	frame.nextTile = 0;
+	ParallelFor(threadPool, 0, threadCount, 1, [&](int, int task, int, int)
+	{
+		const auto start = Clock::now();
+		auto drawTiles = frame.deferredShading ? GetDrawTiles<true>(frame.depthFormat) : GetDrawTiles<false>(frame.depthFormat);
+		drawTiles(frame.buffer, frame.zBuffer, frame.hiZBuffer, frame.visibilityBuffer.data(), obj, frame.cameraSpaceVertices
+			, frame.cameraSpaceNormals, frame.cameraSpaceTangents, frame.drawLists, frame.clippedInputs, frame.drawOffsets, frame.constants, frame.tileBins
+			, frame.initializedTiles.data(), frame.nextTile);
+		busyTime[task] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}).Wait();
+
+	// Deferred shading: shade what ended up visible
+	if (frame.deferredShading)
+	{
+		frame.nextTile = 0;
+		ParallelFor(threadPool, 0, threadCount, 1, [&](int, int task, int, int)
+		{
+			const auto start = Clock::now();
+			ResolveTiles(frame.buffer, frame.visibilityBuffer.data(), obj, frame.cameraSpaceVertices
+				, frame.cameraSpaceNormals, frame.cameraSpaceTangents, frame.drawLists, frame.clippedInputs, frame.drawOffsets, frame.constants
+				, frame.initializedTiles.data(), frame.nextTile);
+			busyTime[task] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		}).Wait();
+	}
+
+	frame.rasterizationTime = 0;
+	for (double time : busyTime) frame.rasterizationTime += time;
+	frame.rasterizationTime /= threadCount;
+
+	// Linearize, scale up and convert for presentation. A linear BGRA8 frame at full size is presented as it is.
+	frame.resolved = frame.output && (frame.buffer.GetLayout() != LayoutLinear || frame.output->GetFormat() != FormatBgra8
+		|| frame.width != frame.output->GetWidth() || frame.height != frame.output->GetHeight());
+	if (frame.resolved)
+	{
+		ParallelFor(threadPool, 0, frame.output->GetHeight(), ResolveGrainSize, [&](int, int, int first, int last)
+		{
+			frame.buffer.Resolve(*frame.output, frame.width, frame.height, first, last);
+		}).Wait();
+	}
+}
+
+void Renderer::SetDeferredShading(bool enabled)
+{
+	deferredShading = enabled;
+}
+
+void Renderer::SetTextureFilter(TextureFilter filter)
+{
+	textureFilter = filter;
+}
+
+void Renderer::SetDepthFormat(DepthFormat format)
+{
+	depthFormat = format;
+}
+
+void Renderer::SetOutputFormat(PixelFormat format)
+{
+	if (format == outputFormat) return;
+
+	Flush();
+	outputFormat = format;
+	CreateFrames();
+}
+
+void Renderer::SetBufferLayout(BufferLayout layout)
+{
+	if (layout == bufferLayout) return;
+
+	Flush();
+	bufferLayout = layout;
+	CreateFrames();
+}
+
+void Renderer::SetDynamicResolution(bool enabled, float budgetMilliseconds)
+{
+	Flush();
+	frameBudget = budgetMilliseconds;
+	resolutionScale = 1.0f;
+	SetRenderSize(outputWidth, outputHeight);
+
+	if (enabled == dynamicResolution) return;
+
+	dynamicResolution = enabled;
+	CreateFrames();
+}
+
+void Renderer::ResetResolutionScale()
+{
+	resolutionScale = 1.0f;
+}
+
+Renderer::Maps Renderer::LoadMaps(const std::string& path)
+{
+	// Shading samples every map, a map that is missing or doesn't decode is replaced by its flat texel
+	Maps maps = CreateProxyMaps();
+
+	// Warm loads map the cached texels, shading reads them in place
+	TextureCache cache;
+	Texture diffuse, specular, normal;
+	if (cache.Load(path + "/Albedo Map.png", diffuse)) maps.diffuse = std::move(diffuse);
+	if (cache.Load(path + "/Specular Map.png", specular)) maps.specular = std::move(specular);
+	if (cache.Load(path + "/Normal Map.png", normal)) maps.normal = std::move(normal);
+
+	return maps;
+}
+
+Renderer::Maps Renderer::CreateProxyMaps()
+{
+	const unsigned char gray[4] = { 128, 128, 128, 255 };
+	const unsigned char black[4] = { 0, 0, 0, 255 };
+	// x and y in the middle of their range, which is the unperturbed normal
+	const unsigned char flat[4] = { 128, 128, 255, 255 };
+
+	Maps maps;
+	maps.diffuse.Create(gray, 1, 1);
+	maps.specular.Create(black, 1, 1);
+	maps.normal.Create(flat, 1, 1);
+
+	return maps;
+}
+
+void Renderer::SetMaps(Maps maps)
+{
+	// Shading of the frame in flight still reads the maps
+	Flush();
+
+	diffuseMap = std::move(maps.diffuse);
+	specularMap = std::move(maps.specular);
+	normalMap = std::move(maps.normal);
 }
 
 void Renderer::SetMaps(std::string path) {
-	normalMap.clear();
-	normalMapLoaded.clear();
-	diffuseMap.clear();
-    specularMap.clear();
-	lodepng::decode(diffuseMap, diffuseMapWidth, diffuseMapHeight, path + "\\Albedo Map.png");
-	lodepng::decode(specularMap, specularMapWidth, specularMapHeight, path + "\\Specular Map.png");
-	lodepng::decode(normalMapLoaded, normalMapWidth, normalMapHeight, path + "\\Normal Map.png");
-
-	for (int i = 0; i < normalMapLoaded.size(); i += 4) 
-		normalMap.push_back(glm::vec3(
-		  normalMapLoaded[i] / 255.0f * 2 - 1
-		, normalMapLoaded[i + 1] / 255.0f * 2 - 1
-		, normalMapLoaded[i + 2] / 255.0f * 2 - 1
-	));
-
-	for (int i = 0; i < normalMap.size(); i++) normalMapTransformed.push_back(normalMap[i]);
-}
-
-void Renderer::CalculateVertices(int id
-	, Obj &renderTarget
+	Flush();
+
+	// Old textures may still map the cache files that are about to be rewritten
+	diffuseMap.Clear();
+	specularMap.Clear();
+
+	SetMaps(LoadMaps(path));
+}
+
+void Renderer::CalculateVertices(const Obj& obj
+	, std::vector<glm::vec4>& screenVertices
 	, std::vector<glm::vec4>& cameraSpaceVertices
+	, std::vector<unsigned char>& vertexOutcodes
 	, int first
 	, int last
 	, const glm::mat4 &pvm
 	, const glm::mat4& vm
-	, const glm::mat4 &viewPort)
+	, const glm::mat4 &viewPort
+	, bool reversedDepth)
 {
-	auto &vertices = renderTarget.vertices;
+	const auto &vertices = obj.vertices;
 
 	for (int i = first; i < last; i++)
 	{
-		vertices[i] = pvm * vertices[i];
+		glm::vec4 vertex = pvm * vertices[i];
+		vertexOutcodes[i] = GetOutcode(vertex, reversedDepth);
 
-		vertices[i].x = vertices[i].x / vertices[i].w;
-		vertices[i].y = vertices[i].y / vertices[i].w;
-		vertices[i].z = vertices[i].z / vertices[i].w;
-		vertices[i].w = 1.0f;
+		vertex.x = vertex.x / vertex.w;
+		vertex.y = vertex.y / vertex.w;
+		vertex.z = vertex.z / vertex.w;
+		vertex.w = 1.0f;
 
-		vertices[i] = viewPort * vertices[i];
+		screenVertices[i] = viewPort * vertex;
 	}
 
 	for (int i = first; i < last; i++)
 	{
-		cameraSpaceVertices[i] = vm * cameraSpaceVertices[i];
+		cameraSpaceVertices[i] = vm * vertices[i];
 	}
-
-	FinishThreadWork();
 }
 
-void Renderer::CalculateNormals(int id
-	, Obj& renderTarget
+void Renderer::CalculateNormals(const Obj& obj
+	, std::vector<glm::vec3>& cameraSpaceNormals
 	, int first
 	, int last
 	, const glm::mat3& TIvm)
 {
-	auto& normals = renderTarget.normals;
+	const auto& normals = obj.normals;
 
 	for (int i = first; i < last; i++)
 	{
-		normals[i] = glm::normalize(TIvm * normals[i]);
+		cameraSpaceNormals[i] = glm::normalize(TIvm * normals[i]);
 	}
-
-	FinishThreadWork();
 }
 
-void Renderer::CalculateNormalsMap(int id
-	, Obj& renderTarget
+void Renderer::CalculateTangents(const Obj& obj
+	, std::vector<glm::vec4>& cameraSpaceTangents
 	, int first
 	, int last
-	, const glm::mat3& TIvm)
+	, const glm::mat3& vm)
 {
+	const auto& tangents = obj.tangents;
+
+	// Tangents lie in the surface, so they transform like positions
 	for (int i = first; i < last; i++)
 	{
-		normalMapTransformed[i] = glm::normalize(TIvm * normalMap[i]);
+		cameraSpaceTangents[i] = glm::vec4(glm::normalize(vm * glm::vec3(tangents[i])), tangents[i].w);
 	}
-
-	FinishThreadWork();
 }
 
 //void Renderer::CalculateLighting(int id
@@ -283,48 +517,394 @@ void Renderer::CalculateNormalsMap(int id
 //	FinishThreadWork();
 //}
 
-void Renderer::DrawPolygons(Buffer& buffer, float* zBuffer, Obj& renderTarget, const std::vector<glm::vec4>& cameraSpaceVertices, const LightSource& lightSource, int first, int last)
+namespace
 {
-	//int width = std::min((int)diffuseMapWidth, Renderer::width);
-	//int height = std::min((int)diffuseMapHeight, Renderer::height);
-	//for (int i = 0; i < width; i++)
-	//	for (int j = 0; j < height; j++)
-	//	{
-	//		int textelNumber = (j * diffuseMapWidth + i) * 4;
-	//		buffer.SetPixel(i, j, RGB(diffuseMap[textelNumber + 2], diffuseMap[textelNumber + 1], diffuseMap[textelNumber + 0]));
-	//	}
 
-	//return;
+struct ClipVertex
+{
+	glm::vec4 clip;
+	glm::vec4 position;
+	glm::vec3 textureCoords;
+	glm::vec3 normal;
+	glm::vec4 tangent;
+};
+
+// Sutherland-Hodgman against one plane, distance is positive inside
+template <typename Distance>
+int ClipAgainstPlane(const ClipVertex* input, int count, ClipVertex* output, Distance distance)
+{
+	int outputCount = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		const ClipVertex& current = input[i];
+		const ClipVertex& next = input[(i + 1) % count];
+		const float currentDistance = distance(current.clip);
+		const float nextDistance = distance(next.clip);
+
+		if (currentDistance >= 0) output[outputCount++] = current;
+
+		if ((currentDistance >= 0) != (nextDistance >= 0))
+		{
+			const float t = currentDistance / (currentDistance - nextDistance);
+			ClipVertex& v = output[outputCount++];
+			v.clip = current.clip + t * (next.clip - current.clip);
+			v.position = current.position + t * (next.position - current.position);
+			v.textureCoords = current.textureCoords + t * (next.textureCoords - current.textureCoords);
+			v.normal = current.normal + t * (next.normal - current.normal);
+			v.tangent = glm::vec4(glm::vec3(current.tangent) + t * (glm::vec3(next.tangent) - glm::vec3(current.tangent)), current.tangent.w);
+		}
+	}
+
+	return outputCount;
+}
+
+}
+
+void Renderer::CullMeshlets(const std::vector<Meshlet>& meshlets
+	, std::vector<unsigned char>& meshletVisibility
+	, int first
+	, int last
+	, const glm::mat4& vm
+	, const glm::mat4& projection)
+{
+	// Frustum planes in camera space, taken from the rows of the projection matrix
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++) rows[i] = glm::vec4(projection[0][i], projection[1][i], projection[2][i], projection[3][i]);
+
+	glm::vec4 planes[6] = { rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[2], rows[3] - rows[2] };
+	for (auto& plane : planes) plane /= glm::length(glm::vec3(plane));
+
+	const glm::mat3 rotation = glm::mat3(vm);
+
+	for (int i = first; i < last; i++)
+	{
+		const Meshlet& meshlet = meshlets[i];
+		const glm::vec3 center = vm * glm::vec4(meshlet.center, 1.0f);
+
+		bool visible = true;
+		for (const auto& plane : planes)
+		{
+			visible &= glm::dot(glm::vec3(plane), center) + plane.w >= -meshlet.radius;
+		}
+
+		// Every polygon faces away from any point of view inside the cone, the camera is at the origin
+		if (visible)
+		{
+			const glm::vec3 axis = rotation * meshlet.coneAxis;
+			visible = glm::dot(center, axis) < meshlet.coneCutoff * glm::length(center) + meshlet.radius;
+		}
+
+		meshletVisibility[i] = visible;
+	}
+}
+
+void Renderer::BinTriangle(TileBins& bins, const Tile& bounds, int drawIndex)
+{
+	const int firstTileX = bounds.left / TileSize;
+	const int lastTileX = (bounds.right - 1) / TileSize;
+	const int firstTileY = bounds.top / TileSize;
+	const int lastTileY = (bounds.bottom - 1) / TileSize;
+
+	for (int tileY = firstTileY; tileY <= lastTileY; tileY++)
+	{
+		for (int tileX = firstTileX; tileX <= lastTileX; tileX++)
+		{
+			bins[tileY * tilesX + tileX].push_back(drawIndex);
+		}
+	}
+}
+
+// Clips in homogeneous space against the near plane and the guard band, the result is a convex polygon
+// which is split into a fan of triangles
+void Renderer::ClipPolygon(const Obj& obj
+	, const std::vector<glm::vec4>& cameraSpaceVertices
+	, const std::vector<glm::vec3>& cameraSpaceNormals
+	, const std::vector<glm::vec4>& cameraSpaceTangents
+	, const glm::mat4& projection
+	, const glm::mat4& viewPort
+	, bool reversedDepth
+	, int polygonIndex
+	, TileBins& bins
+	, std::vector<TriangleSetup>& drawList
+	, std::vector<FragmentInputs>& clippedInputs)
+{
+	// Every plane adds at most one vertex
+	const int maxVertices = 3 + 5;
+	ClipVertex vertices[maxVertices];
+	ClipVertex clipped[maxVertices];
+
+	const glm::ivec3 verticesIndices = obj.polygons.verticesIndices[polygonIndex];
+	const glm::ivec3 textureIndices = obj.polygons.textureIndices[polygonIndex];
+	const glm::ivec3 normalsIndices = obj.polygons.normalsIndices[polygonIndex];
+	const glm::ivec3 tangentsIndices = obj.polygons.tangentsIndices[polygonIndex];
+	for (int i = 0; i < 3; i++)
+	{
+		vertices[i].position = cameraSpaceVertices[verticesIndices[i]];
+		vertices[i].clip = projection * vertices[i].position;
+		vertices[i].textureCoords = obj.textureCoords[textureIndices[i]];
+		vertices[i].normal = cameraSpaceNormals[normalsIndices[i]];
+		vertices[i].tangent = cameraSpaceTangents[tangentsIndices[i]];
+	}
+
+	int count = 3;
+	count = ClipAgainstPlane(vertices, count, clipped, [reversedDepth](const glm::vec4& v) { return GetNearDistance(v, reversedDepth); });
+	count = ClipAgainstPlane(clipped, count, vertices, [](const glm::vec4& v) { return GuardBandScale * v.w + v.x; });
+	count = ClipAgainstPlane(vertices, count, clipped, [](const glm::vec4& v) { return GuardBandScale * v.w - v.x; });
+	count = ClipAgainstPlane(clipped, count, vertices, [](const glm::vec4& v) { return GuardBandScale * v.w + v.y; });
+	count = ClipAgainstPlane(vertices, count, clipped, [](const glm::vec4& v) { return GuardBandScale * v.w - v.y; });
 
-	for (int j = first; j < last; j++)
+	const int polygonsCount = (int)obj.polygons.size();
+
+	for (int i = 1; i + 1 < count; i++)
 	{
-		RasterizeTriangle(buffer, zBuffer, renderTarget, cameraSpaceVertices, lightSource, j);
+		glm::vec4 screenVertices[3];
+		FragmentInputs inputs;
+		const int fan[3] = { 0, i, i + 1 };
+
+		for (int k = 0; k < 3; k++)
+		{
+			const ClipVertex& v = clipped[fan[k]];
+			screenVertices[k] = viewPort * glm::vec4(glm::vec3(v.clip) / v.clip.w, 1.0f);
+			inputs.positions[k] = v.position;
+			inputs.textureCoords[k] = v.textureCoords;
+			inputs.normals[k] = v.normal;
+			inputs.tangents[k] = v.tangent;
+			inputs.w[k] = v.clip.w;
+		}
+
+		TriangleSetup setup;
+		if (!SetupTriangle(screenVertices, polygonsCount + (int)clippedInputs.size(), setup)) continue;
+
+		BinTriangle(bins, setup.bounds, (int)drawList.size());
+		drawList.push_back(setup);
+		clippedInputs.push_back(inputs);
 	}
 }
 
-void Renderer::WaitForThreads()
+void Renderer::SetupPolygons(const Obj& obj
+	, const std::vector<glm::vec4>& screenVertices
+	, const std::vector<glm::vec4>& cameraSpaceVertices
+	, const std::vector<glm::vec3>& cameraSpaceNormals
+	, const std::vector<glm::vec4>& cameraSpaceTangents
+	, const std::vector<unsigned char>& vertexOutcodes
+	, const glm::mat4& projection
+	, const glm::mat4& viewPort
+	, bool reversedDepth
+	, const std::vector<unsigned char>& meshletVisibility
+	, TileBins& bins
+	, std::vector<TriangleSetup>& drawList
+	, std::vector<FragmentInputs>& clippedInputs
+	, int first
+	, int last)
 {
-	std::unique_lock<std::mutex> lock(mutex);
-	if (workingThreads != 0)
+	for (auto& bin : bins) bin.clear();
+	drawList.clear();
+	clippedInputs.clear();
+
+	const auto& vertices = screenVertices;
+
+	for (int m = first; m < last; m++)
 	{
-		cv.wait(lock);
+		if (!meshletVisibility[m]) continue;
+
+		const Meshlet& meshlet = obj.meshlets[m];
+		const int polygonsEnd = meshlet.firstPolygon + meshlet.polygonsCount;
+
+		for (int i = meshlet.firstPolygon; i < polygonsEnd; i++)
+		{
+			const glm::ivec3 indices = obj.polygons.verticesIndices[i];
+			const unsigned char outcodes[3] = { vertexOutcodes[indices[0]], vertexOutcodes[indices[1]], vertexOutcodes[indices[2]] };
+
+			// All vertices are outside of the same frustum plane
+			if (outcodes[0] & outcodes[1] & outcodes[2] & OutsideFrustum) continue;
+
+			// Crosses the near plane or leaves the guard band, anything else is left to the rasterizer bounds
+			if ((outcodes[0] | outcodes[1] | outcodes[2]) & NeedsClipping)
+			{
+				ClipPolygon(obj, cameraSpaceVertices, cameraSpaceNormals, cameraSpaceTangents, projection, viewPort, reversedDepth, i, bins, drawList, clippedInputs);
+				continue;
+			}
+
+			const glm::vec4 screenVertices[3] = { vertices[indices[0]], vertices[indices[1]], vertices[indices[2]] };
+			TriangleSetup setup;
+			if (!SetupTriangle(screenVertices, i, setup)) continue;
+
+			BinTriangle(bins, setup.bounds, (int)drawList.size());
+			drawList.push_back(setup);
+		}
 	}
 }
 
-void Renderer::FinishThreadWork()
+Renderer::Tile Renderer::GetTile(int tileIndex)
 {
-	std::unique_lock<std::mutex> lock(mutex);
-	workingThreads--;
-	if (workingThreads == 0)
+	Tile tile;
+	tile.left = (tileIndex % tilesX) * TileSize;
+	tile.top = (tileIndex / tilesX) * TileSize;
+	tile.right = (std::min)(tile.left + TileSize, width);
+	tile.bottom = (std::min)(tile.top + TileSize, height);
+	return tile;
+}
+
+template <bool Deferred, DepthFormat Format>
+void Renderer::DrawTiles(Buffer& buffer
+	, DepthBuffer& depthBuffer
+	, HiZBuffer& hiZBuffer
+	, int* visibilityBuffer
+	, const Obj& obj
+	, const std::vector<glm::vec4>& cameraSpaceVertices
+	, const std::vector<glm::vec3>& cameraSpaceNormals
+	, const std::vector<glm::vec4>& cameraSpaceTangents
+	, const std::vector<std::vector<TriangleSetup>>& drawLists
+	, const std::vector<std::vector<FragmentInputs>>& clippedInputs
+	, const std::vector<int>& drawOffsets
+	, const ShadingConstants& constants
+	, const std::vector<TileBins>& tileBins
+	, unsigned char* initializedTiles
+	, std::atomic<int>& nextTile)
+{
+	const int tilesCount = tilesX * tilesY;
+	auto zBuffer = depthBuffer.GetData<Format>();
+
+	FragmentInputs inputs;
+
+	for (int tileIndex = nextTile++; tileIndex < tilesCount; tileIndex = nextTile++)
 	{
-		lock.unlock();
-		cv.notify_one();
+		const Tile tile = GetTile(tileIndex);
+
+		// Bins are filled from consecutive polygon ranges, so this keeps the submission order
+		for (int task = 0; task < (int)tileBins.size(); task++)
+		{
+			for (int drawIndex : tileBins[task][tileIndex])
+			{
+				const TriangleSetup& setup = drawLists[task][drawIndex];
+
+				if (!initializedTiles[tileIndex])
+				{
+					InitializeTile<Deferred, Format>(buffer, zBuffer, hiZBuffer, visibilityBuffer, tile);
+					initializedTiles[tileIndex] = 1;
+				}
+
+				// Only forward shading needs the attributes here
+				if constexpr (!Deferred)
+				{
+					GetFragmentInputs(obj, cameraSpaceVertices, cameraSpaceNormals, cameraSpaceTangents, clippedInputs[task], setup, inputs);
+				}
+
+				RasterizeTriangle<Deferred, Format>(buffer, zBuffer, hiZBuffer, visibilityBuffer, setup, inputs, constants, drawOffsets[task] + drawIndex, tile);
+			}
+		}
+
+		// Nothing will test against this tile, it only needs to look cleared when presented
+		if (!initializedTiles[tileIndex])
+		{
+			buffer.ClearRect(tile.left, tile.top, tile.right, tile.bottom, ClearColor);
+		}
 	}
 }
 
-void Renderer::ClearZBuffer()
+// Shades every covered pixel exactly once. Neighbouring pixels mostly belong to the same triangle,
+// so its attributes are fetched again only when the draw list index changes.
+void Renderer::ResolveTiles(Buffer& buffer
+	, const int* visibilityBuffer
+	, const Obj& obj
+	, const std::vector<glm::vec4>& cameraSpaceVertices
+	, const std::vector<glm::vec3>& cameraSpaceNormals
+	, const std::vector<glm::vec4>& cameraSpaceTangents
+	, const std::vector<std::vector<TriangleSetup>>& drawLists
+	, const std::vector<std::vector<FragmentInputs>>& clippedInputs
+	, const std::vector<int>& drawOffsets
+	, const ShadingConstants& constants
+	, const unsigned char* initializedTiles
+	, std::atomic<int>& nextTile)
 {
-	memcpy(zBuffer, zBufferInitial, width * height * sizeof(float));
+	const int tilesCount = tilesX * tilesY;
+
+	const TriangleSetup* setup = nullptr;
+	FragmentInputs inputs;
+	FragmentBatch batch;
+
+	for (int tileIndex = nextTile++; tileIndex < tilesCount; tileIndex = nextTile++)
+	{
+		// Holds only the clear color
+		if (!initializedTiles[tileIndex]) continue;
+
+		const Tile tile = GetTile(tileIndex);
+		int currentDrawIndex = -1;
+		batch.count = 0;
+
+		for (int y = tile.top; y < tile.bottom; y++)
+		{
+			for (int x = tile.left; x < tile.right; x++)
+			{
+				const int drawIndex = visibilityBuffer[y * width + x];
+				if (drawIndex < 0) continue;
+
+				if (drawIndex != currentDrawIndex)
+				{
+					if (batch.count != 0)
+					{
+						shadeFragments(buffer, inputs, batch, constants);
+						batch.count = 0;
+					}
+
+					// Last task whose draw list starts at or before the index
+					const int task = (int)(std::upper_bound(drawOffsets.begin(), drawOffsets.end(), drawIndex) - drawOffsets.begin()) - 1;
+					setup = &drawLists[task][drawIndex - drawOffsets[task]];
+					GetFragmentInputs(obj, cameraSpaceVertices, cameraSpaceNormals, cameraSpaceTangents, clippedInputs[task], *setup, inputs);
+					currentDrawIndex = drawIndex;
+				}
+
+				batch.pixels[batch.count] = buffer.GetIndex(x, y);
+				for (int i = 0; i < 3; i++)
+				{
+					batch.barycentric[i][batch.count] = EvaluateEdge(*setup, i, x, y) * setup->invArea;
+				}
+
+				if (++batch.count == FragmentBatchSize)
+				{
+					shadeFragments(buffer, inputs, batch, constants);
+					batch.count = 0;
+				}
+			}
+		}
+
+		if (batch.count != 0)
+		{
+			shadeFragments(buffer, inputs, batch, constants);
+		}
+	}
+}
+
+void Renderer::ShadeFragmentsScalar(Buffer& buffer, const FragmentInputs& inputs, const FragmentBatch& batch, const ShadingConstants& constants)
+{
+	for (int i = 0; i < batch.count; i++)
+	{
+		const glm::vec3 barycentric(batch.barycentric[0][i], batch.barycentric[1][i], batch.barycentric[2][i]);
+		buffer.GetPixels()[batch.pixels[i]] = ShadeFragment(inputs, barycentric, constants);
+	}
+}
+
+// Fast clear of one tile, done right before the first polygon is drawn into it
+template <bool Deferred, DepthFormat Format>
+void Renderer::InitializeTile(Buffer& buffer, typename DepthTraits<Format>::Type* zBuffer, HiZBuffer& hiZBuffer, int* visibilityBuffer, const Tile& tile)
+{
+	typedef DepthTraits<Format> Depth;
+	const auto clearValue = Depth::Encode(Depth::ClearKey);
+
+	buffer.ClearRect(tile.left, tile.top, tile.right, tile.bottom, ClearColor);
+
+	for (int y = tile.top; y < tile.bottom; y++)
+	{
+		std::fill(zBuffer + y * width + tile.left, zBuffer + y * width + tile.right, clearValue);
+
+		if constexpr (Deferred)
+		{
+			std::fill(visibilityBuffer + y * width + tile.left, visibilityBuffer + y * width + tile.right, -1);
+		}
+	}
+
+	hiZBuffer.ClearTile(tile.left / TileSize, tile.top / TileSize, Depth::Decode(clearValue));
 }
 
 }
\ No newline at end of file
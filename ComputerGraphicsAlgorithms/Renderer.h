@@ -4,97 +4,392 @@
 
 #include <memory>
 #include <functional>
-#include <mutex>
+#include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
 
 #include <ctpl/ctpl_stl.h>
 #include <glm/glm.hpp>
 
 #include "Buffer.h"
+#include "Color.h"
 #include "Scene.h"
 #include "Obj.h"
 #include "LightSource.h"
+#include "DepthBuffer.h"
+#include "HiZBuffer.h"
+#include "ParallelFor.h"
+#include "Texture.h"
 
 //#define DISCARD_VERTICES
 
 namespace cga
 {
 
+const int TileSize = 64;
+
+// Frames in the pipeline ring: one in geometry processing, one rasterizing and one presented
+const int FramesInFlight = 3;
+
+// Minimum amount of work per pool task in the geometry stages
+const int VertexGrainSize = 4096;
+const int MeshletGrainSize = 16;
+// Rows per task when a frame is converted into the output format
+const int ResolveGrainSize = 16;
+
+// Dynamic resolution never draws less than this fraction of the output size and changes the scale in these steps
+const float MinResolutionScale = 0.5f;
+const float ResolutionScaleStep = 0.0625f;
+const int BlockSize = 8;
+const long long SubpixelScale = 16;
+const int FragmentBatchSize = 8;
+const float HiZBias = 1e-6f;
+const Color ClearColor = MakeRgb(50, 200, 50);
+
+// Polygons are only clipped against the guard band, a region this many times larger than the
+// viewport, everything between it and the viewport is handled by the rasterizer's bounds.
+// It also keeps fixed point screen coordinates far away from overflow.
+const float GuardBandScale = 16.0f;
+
+// Clip space outcodes, computed per vertex
+enum ClipOutcode : unsigned char
+{
+	OutsideLeft = 1,
+	OutsideRight = 2,
+	OutsideBottom = 4,
+	OutsideTop = 8,
+	OutsideNear = 16,
+	OutsideFar = 32,
+	OutsideGuardBand = 64,
+	OutsideFrustum = OutsideLeft | OutsideRight | OutsideBottom | OutsideTop | OutsideNear | OutsideFar,
+	NeedsClipping = OutsideNear | OutsideGuardBand
+};
+
 class Renderer
 {
 public:
+	// Everything shading samples, loaded apart from the renderer so that it can happen on another thread
+	struct Maps
+	{
+		Texture diffuse;
+		Texture specular;
+		Texture normal;
+	};
+
 	Renderer(int aWidth, int aHeight, std::function<void()> aInvalidateCallback);
 	~Renderer();
 
 	Buffer& GetCurrentBuffer();
 
+	// Processes the geometry of a new frame, presents the previous one and starts rasterizing the new one.
+	// The scene's mesh must stay unchanged until the frame is presented, see Flush.
 	void Render(std::unique_ptr<Scene> &scene);
+
+	// Waits for the frame in flight and presents it
+	void Flush();
+
+	void SetDeferredShading(bool enabled);
+	void SetTextureFilter(TextureFilter filter);
+
+	// Takes effect with the next frame
+	void SetDepthFormat(DepthFormat format);
+
+	// Pixel format of the buffers GetCurrentBuffer returns. Frames are drawn in BGRA8 and converted when they
+	// finish, BGRA8 is presented without a copy unless the frame buffers are tiled. Both reallocate the frames.
+	void SetOutputFormat(PixelFormat format);
+	void SetBufferLayout(BufferLayout layout);
+
+	// Draws frames at a fraction of the output size that follows how long rasterization and shading took
+	// against the budget, and scales them up bilinearly into the output buffer. Frames at full size are
+	// presented without the scaling copy when the output format and layout allow it. Reallocates the frames.
+	void SetDynamicResolution(bool enabled, float budgetMilliseconds);
+
+	inline float GetResolutionScale() const
+	{
+		return resolutionScale;
+	}
+
+	// The next frame is drawn at the full output size, e.g. for a still view
+	void ResetResolutionScale();
+
+	// Reads the albedo, specular and normal maps of a directory, safe to call from any thread.
+	// Maps that can't be loaded are the ones of CreateProxyMaps.
+	static Maps LoadMaps(const std::string& path);
+
+	// One texel each: gray albedo, no specular and a flat normal, for a scene whose maps are still loading
+	static Maps CreateProxyMaps();
+
+	// Takes the maps over once the frame in flight is presented
+	void SetMaps(Maps maps);
     void SetMaps(std::string path);
 
 private:
-	static int workingThreads;
-	static std::mutex mutex;
-	static std::condition_variable cv;
-	static int width, height;
+	// Screen rectangle, right and bottom are exclusive
+	struct Tile
+	{
+		int left, top, right, bottom;
+	};
 
-	static std::vector<unsigned char> diffuseMap;
-	static unsigned diffuseMapWidth, diffuseMapHeight;
+	// Draw list indices per tile, one set of bins per setup task so no locking is needed
+	typedef std::vector<std::vector<int>> TileBins;
 
-	static std::vector<unsigned char> specularMap;
-	static unsigned specularMapWidth, specularMapHeight;
+	// Per-polygon data the shading stage interpolates. w is the clip space w used for perspective correction,
+	// the barycentric steps per pixel give texture coordinate derivatives for mip selection.
+	// Normals and tangents are in camera space and span the tangent frame of the normal map.
+	struct FragmentInputs
+	{
+		glm::vec4 positions[3];
+		glm::vec3 textureCoords[3];
+		glm::vec3 normals[3];
+		glm::vec4 tangents[3];
+		float w[3];
+		glm::vec3 barycentricDx, barycentricDy;
+	};
+
+	// Draw list record of a polygon that survived culling, everything the rasterizer needs without going back to the mesh.
+	// Fixed point edge equations: edge i is opposite to vertex i, so its value at a pixel is the unnormalized barycentric of that vertex.
+	struct TriangleSetup
+	{
+		long long x[3], y[3];
+		long long stepX[3], stepY[3];
+		long long threshold[3];
+		float invArea;
+		float depths[3];
+		float minDepth;
+		int triangleId;
+		Tile bounds;
+	};
+
+	// Fragments of one polygon that passed the depth test, kept in SoA form for the shading kernels.
+	// Pixels are frame buffer indices, see Buffer::GetIndex.
+	struct FragmentBatch
+	{
+		int count;
+		int pixels[FragmentBatchSize];
+		float barycentric[3][FragmentBatchSize];
+	};
+
+	// Per-frame values the shading kernels read, the light is in camera space
+	struct ShadingConstants
+	{
+		LightSource lightSource;
+		TextureFilter textureFilter;
+	};
 
+	typedef void (*ShadeFragmentsFunction)(Buffer& buffer, const FragmentInputs& inputs, const FragmentBatch& batch, const ShadingConstants& constants);
+
+	// Everything one frame owns while it moves through the pipeline. Frames are reused in a ring,
+	// so their buffers and streams keep their capacity.
+	struct Frame
+	{
+		Frame(int aWidth, int aHeight, int aTaskCount, BufferLayout aLayout);
+
+		// Sized for the output, a frame drawn at a lower resolution uses the top left width x height pixels
+		int width, height;
+		Buffer buffer;
+
+		// Linear copy of the buffer in the output format and size, made at the end of rasterization.
+		// Null when the buffer itself can be presented, and skipped by frames that don't need it.
+		std::unique_ptr<Buffer> output;
+		bool resolved = false;
+		DepthFormat depthFormat = DepthFloat32;
+		DepthBuffer zBuffer;
+		HiZBuffer hiZBuffer;
+
+		// Draw list index per pixel, -1 where nothing was drawn. Only used with deferred shading.
+		bool deferredShading = false;
+		std::vector<int> visibilityBuffer;
+
+		// Fast clear: tiles start every frame only logically cleared (0). The first polygon binned to a tile
+		// initializes its color, depth and visibility (1), tiles nothing is binned to only get the clear color.
+		std::vector<unsigned char> initializedTiles;
+
+		const Obj* obj = nullptr;
+		ShadingConstants constants;
+
+		// Vertex streams, the scene's mesh is never modified
+		std::vector<glm::vec4> screenVertices;
+		std::vector<glm::vec4> cameraSpaceVertices;
+		std::vector<glm::vec3> cameraSpaceNormals;
+		std::vector<glm::vec4> cameraSpaceTangents;
+		std::vector<unsigned char> vertexOutcodes;
+		std::vector<unsigned char> meshletVisibility;
+
+		std::vector<TileBins> tileBins;
+
+		// Draw lists and attributes of clipped polygons per setup task. Clipped polygons get triangle ids after
+		// the scene polygons, local to their task. Draw list indices are made global with drawOffsets.
+		std::vector<std::vector<TriangleSetup>> drawLists;
+		std::vector<std::vector<FragmentInputs>> clippedInputs;
+		std::vector<int> drawOffsets;
+		std::atomic<int> nextTile;
+
+		std::future<void> rasterization;
+
+		// Rasterization and shading, without the resolve, as the average busy time of the raster tasks.
+		// They queue behind the geometry of the next frame on the pool, the wall time would count that too.
+		double rasterizationTime = 0;
+	};
+
+	// Render size of the frames in flight, which is smaller than the output size with dynamic resolution
+	static int width, height;
+	static int tilesX, tilesY;
 
-	static std::vector<unsigned char> normalMapLoaded;
-	static std::vector<glm::vec3> normalMap;
-	static std::vector<glm::vec3> normalMapTransformed;
-	static unsigned normalMapWidth, normalMapHeight;
+	// Picked once at startup: the AVX2 kernel when the CPU supports it, the scalar one otherwise
+	static ShadeFragmentsFunction shadeFragments;
+
+	static Texture diffuseMap;
+	static Texture specularMap;
+
+	// Tangent space normals in red and green, z is reconstructed. Point sampled from the full size level.
+	static Texture normalMap;
 
 	ctpl::thread_pool threadPool;
 	int threadCount;
 
-	Obj renderTarget;
+	// Persistent thread that drives the rasterization of one frame at a time, spreading the work over threadPool.
+	// It waits on the pool, so it can't be a pool task itself.
+	ctpl::thread_pool rasterizationThread;
+
 	LightSource lightSource;
-	std::vector<glm::vec4> cameraSpaceVertices;
-	Buffer buffer, backBuffer;
-	float* zBuffer;
-	float* zBufferInitial;
+
+	std::vector<std::unique_ptr<Frame>> frames;
+	int nextFrame = 0;
+	bool deferredShading = false;
+	TextureFilter textureFilter = FilterTrilinear;
+	DepthFormat depthFormat = DepthFloat32;
+	PixelFormat outputFormat = FormatBgra8;
+	BufferLayout bufferLayout = LayoutLinear;
+
+	int outputWidth, outputHeight;
+	bool dynamicResolution = false;
+	float frameBudget = 0;
+	float resolutionScale = 1.0f;
+
+	// Rasterizing while the next frame's geometry is processed, presented by the next Render or Flush
+	Frame* pendingFrame = nullptr;
+	Frame* presentedFrame;
 
 	std::string scenePath;
 
 	std::function<void()> aInvalidateCallback;
 
-	void ClearZBuffer();
+	void ProcessGeometry(Frame& frame, Scene& scene);
+	void Rasterize(Frame& frame);
+	void CreateFrames();
+	void SetRenderSize(int aWidth, int aHeight);
+	void UpdateResolutionScale(double rasterizationTime);
+	void ApplyResolutionScale();
 
-	static void CalculateVertices(int id
-		, Obj &renderTarget
+	static void CalculateVertices(const Obj& obj
+		, std::vector<glm::vec4>& screenVertices
 		, std::vector<glm::vec4>& cameraSpaceVertices
+		, std::vector<unsigned char>& vertexOutcodes
 		, int first
 		, int last
 		, const glm::mat4 &pvm
 		, const glm::mat4& vm
-		, const glm::mat4 &viewPort);
-	static void CalculateNormals(int id
-		, Obj& renderTarget
+		, const glm::mat4 &viewPort
+		, bool reversedDepth);
+	static void CalculateNormals(const Obj& obj
+		, std::vector<glm::vec3>& cameraSpaceNormals
 		, int first
 		, int last
 		, const glm::mat3& TIvm);
-	static void CalculateNormalsMap(int id
-		, Obj& renderTarget
+	static void CalculateTangents(const Obj& obj
+		, std::vector<glm::vec4>& cameraSpaceTangents
 		, int first
 		, int last
-		, const glm::mat3& TIvm);
+		, const glm::mat3& vm);
 	static void CalculateLighting(int id
 		, Obj& renderTarget
 		, const std::vector<glm::vec4>& cameraSpaceVertices
 		, int first
 		, int last
 		, const LightSource& lightSource);
-	void DrawPolygons(Buffer &buffer, float* zBuffer, Obj &renderTarget, const std::vector<glm::vec4>& cameraSpaceVertices, const LightSource& lightSource, int first, int last);
-	static void WaitForThreads();
-	static void FinishThreadWork();
+	static void CullMeshlets(const std::vector<Meshlet>& meshlets
+		, std::vector<unsigned char>& meshletVisibility
+		, int first
+		, int last
+		, const glm::mat4& vm
+		, const glm::mat4& projection);
+	static void BinTriangle(TileBins& bins, const Tile& bounds, int drawIndex);
+
+	static void ClipPolygon(const Obj& obj
+		, const std::vector<glm::vec4>& cameraSpaceVertices
+		, const std::vector<glm::vec3>& cameraSpaceNormals
+		, const std::vector<glm::vec4>& cameraSpaceTangents
+		, const glm::mat4& projection
+		, const glm::mat4& viewPort
+		, bool reversedDepth
+		, int polygonIndex
+		, TileBins& bins
+		, std::vector<TriangleSetup>& drawList
+		, std::vector<FragmentInputs>& clippedInputs);
+
+	static void SetupPolygons(const Obj& obj
+		, const std::vector<glm::vec4>& screenVertices
+		, const std::vector<glm::vec4>& cameraSpaceVertices
+		, const std::vector<glm::vec3>& cameraSpaceNormals
+		, const std::vector<glm::vec4>& cameraSpaceTangents
+		, const std::vector<unsigned char>& vertexOutcodes
+		, const glm::mat4& projection
+		, const glm::mat4& viewPort
+		, bool reversedDepth
+		, const std::vector<unsigned char>& meshletVisibility
+		, TileBins& bins
+		, std::vector<TriangleSetup>& drawList
+		, std::vector<FragmentInputs>& clippedInputs
+		, int first
+		, int last);
+	template <bool Deferred, DepthFormat Format>
+	static void DrawTiles(Buffer& buffer
+		, DepthBuffer& zBuffer
+		, HiZBuffer& hiZBuffer
+		, int* visibilityBuffer
+		, const Obj& obj
+		, const std::vector<glm::vec4>& cameraSpaceVertices
+		, const std::vector<glm::vec3>& cameraSpaceNormals
+		, const std::vector<glm::vec4>& cameraSpaceTangents
+		, const std::vector<std::vector<TriangleSetup>>& drawLists
+		, const std::vector<std::vector<FragmentInputs>>& clippedInputs
+		, const std::vector<int>& drawOffsets
+		, const ShadingConstants& constants
+		, const std::vector<TileBins>& tileBins
+		, unsigned char* initializedTiles
+		, std::atomic<int>& nextTile);
+	static void ResolveTiles(Buffer& buffer
+		, const int* visibilityBuffer
+		, const Obj& obj
+		, const std::vector<glm::vec4>& cameraSpaceVertices
+		, const std::vector<glm::vec3>& cameraSpaceNormals
+		, const std::vector<glm::vec4>& cameraSpaceTangents
+		, const std::vector<std::vector<TriangleSetup>>& drawLists
+		, const std::vector<std::vector<FragmentInputs>>& clippedInputs
+		, const std::vector<int>& drawOffsets
+		, const ShadingConstants& constants
+		, const unsigned char* initializedTiles
+		, std::atomic<int>& nextTile);
+	static Tile GetTile(int tileIndex);
+
+	static inline int GetTileCount(int aWidth, int aHeight)
+	{
+		return ((aWidth + TileSize - 1) / TileSize) * ((aHeight + TileSize - 1) / TileSize);
+	}
 
-	static inline void RasterizeLine(Buffer& buffer, float* zBuffer, const glm::vec4& a, const glm::vec4& b, COLORREF color)
+	// DrawTiles instance for a depth format, all of them share one signature
+	template <bool Deferred>
+	static auto GetDrawTiles(DepthFormat format);
+	template <bool Deferred, DepthFormat Format>
+	static void InitializeTile(Buffer& buffer, typename DepthTraits<Format>::Type* zBuffer, HiZBuffer& hiZBuffer, int* visibilityBuffer, const Tile& tile);
+	static void ShadeFragmentsScalar(Buffer& buffer, const FragmentInputs& inputs, const FragmentBatch& batch, const ShadingConstants& constants);
+	static void ShadeFragmentsAvx2(Buffer& buffer, const FragmentInputs& inputs, const FragmentBatch& batch, const ShadingConstants& constants);
+	static bool IsAvx2Supported();
+
+	static inline void RasterizeLine(Buffer& buffer, float* zBuffer, const glm::vec4& a, const glm::vec4& b, Color color)
 	{
 		if (a.x < 0 || a.x >= width || a.y < 0 || a.y >= height ||
 			b.x < 0 || b.x >= width || b.y < 0 || b.y >= height ||
@@ -127,7 +422,7 @@ private:
 		}
 	}
 
-	static inline void MyCoolDrawHorLine(Buffer& buffer, float* zBuffer, int y, int x1, int x2, float z1, float z2, COLORREF color)
+	static inline void MyCoolDrawHorLine(Buffer& buffer, float* zBuffer, int y, int x1, int x2, float z1, float z2, Color color)
 	{
 		const int yMulWidth = y * width;
 		auto Zinc = (z2 - z1) / (float)(x2 - x1 + 1);
@@ -144,208 +439,334 @@ private:
 		}
 	}
 
-	static COLORREF inline GetRgbFromMap(const std::vector<unsigned char>& map, float u, float v)
+	static Color inline GetRgbFromMap(const Texture& map, float u, float v, const glm::vec2& dx, const glm::vec2& dy, TextureFilter filter)
 	{
-		int i = std::min((int)(u * (diffuseMapWidth - 1)), (int)diffuseMapWidth - 1);
-		int j = std::min((int)((1 - v) * (diffuseMapHeight - 1)), (int)diffuseMapHeight - 1);
-		int textelIndex = (j * diffuseMapWidth + i) * 4;
-		return RGB(map[textelIndex + 0], map[textelIndex + 1], map[textelIndex + 1]);
+		const glm::vec4 texel = map.Sample(u, v, map.GetLod(dx, dy), filter) + 0.5f;
+		return MakeRgb((std::uint8_t)texel.x, (std::uint8_t)texel.y, (std::uint8_t)texel.y);
 	}
 
 
-	static glm::vec3 inline GetSpecularFromMap(const std::vector<unsigned char>& map, float u, float v)
+	static glm::vec3 inline GetSpecularFromMap(const Texture& map, float u, float v, const glm::vec2& dx, const glm::vec2& dy, TextureFilter filter)
+	{
+		const glm::vec4 texel = map.Sample(u, v, map.GetLod(dx, dy), filter);
+		return glm::vec3(texel.x / 255.0f, texel.y / 255.0f, texel.y / 255.0f);
+	}
+
+	static glm::vec3 inline GetNormalFromMap(float u, float v)
 	{
-		int i = std::min((int)(u * (diffuseMapWidth - 1)), (int)diffuseMapWidth - 1);
-		int j = std::min((int)((1 - v) * (diffuseMapHeight - 1)), (int)diffuseMapHeight - 1);
-		int textelIndex = (j * diffuseMapWidth + i) * 4;
-		return glm::vec3(map[textelIndex + 0] / 255.0f, map[textelIndex + 1] / 255.0f, map[textelIndex + 1] / 255.0f);
+		const int width = normalMap.GetWidth();
+		const int height = normalMap.GetHeight();
+		const int i = std::min((int)(u * (width - 1)), width - 1);
+		const int j = std::min((int)((1 - v) * (height - 1)), height - 1);
+
+		const std::uint32_t texel = normalMap.Fetch(0, std::max(i, 0), std::max(j, 0));
+		const float x = (texel & 0xFF) / 255.0f * 2 - 1;
+		const float y = ((texel >> 8) & 0xFF) / 255.0f * 2 - 1;
+		return glm::vec3(x, y, std::sqrt(std::max(1 - x * x - y * y, 0.0f)));
 	}
 
-	static const glm::vec3 inline &GetNormalFromMap(float u, float v)
+	// Snaps a screen coordinate to the rasterizer's fixed point grid
+	static inline long long ToSubpixel(float value)
 	{
-		int i = std::min((int)(u * (normalMapWidth - 1)), (int)normalMapWidth - 1);
-		int j = std::min((int)((1 - v) * (normalMapHeight - 1)), (int)normalMapHeight - 1);
-		int textelIndex = (j * normalMapWidth + i);
-		return normalMapTransformed[textelIndex];
+		return static_cast<long long>(std::floor(value * SubpixelScale + 0.5f));
 	}
 
-	static inline void RasterizeTriangle(Buffer& buffer, float* zBuffer, Obj& renderTarget, const std::vector<glm::vec4>& cameraSpaceVertices, const LightSource& lightSource, int polygonIndex)
+	// Clip space depth measured from the near plane, for both projections
+	static inline float GetNearDistance(const glm::vec4& v, bool reversedDepth)
 	{
-		const auto& vertices = renderTarget.vertices;
-		const auto& polygon = renderTarget.polygons[polygonIndex];
-		auto& normals = renderTarget.normals;
-
-		auto txc0 = renderTarget.textureCoords[polygon.textureIndices[0]];
-		auto txc1 = renderTarget.textureCoords[polygon.textureIndices[1]];
-		auto txc2 = renderTarget.textureCoords[polygon.textureIndices[2]];
-
-		const glm::vec4* a = &cameraSpaceVertices[polygon.verticesIndices[0]];
-		const glm::vec4* b = &cameraSpaceVertices[polygon.verticesIndices[1]];
-		const glm::vec4* c = &cameraSpaceVertices[polygon.verticesIndices[2]];
-
-		const int iv0 = polygon.verticesIndices[0];
-		const int iv1 = polygon.verticesIndices[1];
-		const int iv2 = polygon.verticesIndices[2];
-		const auto& v0 = vertices[iv0];
-		const auto& v1 = vertices[iv1];
-		const auto& v2 = vertices[iv2];
-		int v0x = v0.x;
-		int v0y = v0.y;
-		float v0z = v0.z;
-		int v1x = v1.x;
-		int v1y = v1.y;
-		float v1z = v1.z;
-		int v2x = v2.x;
-		int v2y = v2.y;
-		float v2z = v2.z;
-
-		glm::vec3* nA = &normals[polygon.normalsIndices[0]];
-		glm::vec3* nB = &normals[polygon.normalsIndices[1]];
-		glm::vec3* nC = &normals[polygon.normalsIndices[2]];
-
-		auto m = (v1x - v0x) * (v2y - v1y) - (v2x - v1x) * (v1y - v0y);
-		if (m >= 0) return;
-
-		if (v0z < 0 || v0z > 1 ||
-			v1z < 0 || v1z > 1 ||
-			v2z < 0 || v2z > 1) return;
-
-		if (v0y == v1y && v0y == v2y) return; // don't care about degenerate triangles
+		return reversedDepth ? v.w - v.z : v.z;
+	}
 
+	static inline unsigned char GetOutcode(const glm::vec4& v, bool reversedDepth)
+	{
+		const float depth = GetNearDistance(v, reversedDepth);
+
+		unsigned char outcode = 0;
+		if (v.x < -v.w) outcode |= OutsideLeft;
+		if (v.x > v.w) outcode |= OutsideRight;
+		if (v.y < -v.w) outcode |= OutsideBottom;
+		if (v.y > v.w) outcode |= OutsideTop;
+		if (depth < 0) outcode |= OutsideNear;
+		if (depth > v.w) outcode |= OutsideFar;
+		if (std::abs(v.x) > GuardBandScale * v.w || std::abs(v.y) > GuardBandScale * v.w) outcode |= OutsideGuardBand;
+		return outcode;
+	}
+
+	// Rejects backfacing and degenerate polygons and computes edge equations. Vertices are in screen space
+	// and have already been clipped, anything past the far plane is left to the depth test.
+	static inline bool SetupTriangle(const glm::vec4 vertices[3], int triangleId, TriangleSetup& setup)
+	{
+		const auto& v0 = vertices[0];
+		const auto& v1 = vertices[1];
+		const auto& v2 = vertices[2];
+
+		auto& x = setup.x;
+		auto& y = setup.y;
+		x[0] = ToSubpixel(v0.x); y[0] = ToSubpixel(v0.y);
+		x[1] = ToSubpixel(v1.x); y[1] = ToSubpixel(v1.y);
+		x[2] = ToSubpixel(v2.x); y[2] = ToSubpixel(v2.y);
+
+		// Backfacing and degenerate polygons have non-negative area
+		const long long area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (area >= 0) return false;
+
+		// Edges are oriented so that the inside of a front face is non-negative
+		for (int i = 0; i < 3; i++)
 		{
-			if (v0y > v1y)
-			{
-				std::swap(v0x, v1x);
-				std::swap(v0y, v1y);
-				std::swap(v0z, v1z);
-				auto temp = nA;
-				nA = nB;
-				nB = temp;
-				auto temp1 = a;
-				a = b;
-				b = temp1;
-				auto temp3 = txc0;
-				txc0 = txc1;
-				txc1 = temp3;
-			};
-			if (v0y > v2y)
-			{
-				std::swap(v0x, v2x);
-				std::swap(v0y, v2y);
-				std::swap(v0z, v2z);
-				auto temp = nA;
-				nA = nC;
-				nC = temp;
-				auto temp1 = a;
-				a = c;
-				c = temp1;
-				auto temp3 = txc0;
-				txc0 = txc2;
-				txc2 = temp3;
-			};
-			if (v1y > v2y)
-			{
-				std::swap(v1x, v2x);
-				std::swap(v1y, v2y);
-				std::swap(v1z, v2z);
-				auto temp = nB;
-				nB = nC;
-				nC = temp;
-				auto temp1 = b;
-				b = c;
-				c = temp1;
-				auto temp3 = txc1;
-				txc1 = txc2;
-				txc2 = temp3;
-			};
+			const int a = (i + 1) % 3;
+			const int b = (i + 2) % 3;
+			setup.stepX[i] = y[b] - y[a];
+			setup.stepY[i] = x[a] - x[b];
+
+			// Top-left fill rule, pixels exactly on a shared edge belong to one polygon only
+			const bool topLeft = setup.stepX[i] > 0 || (setup.stepX[i] == 0 && setup.stepY[i] > 0);
+			setup.threshold[i] = topLeft ? 0 : 1;
+		}
+
+		setup.invArea = 1.0f / (float)(-area);
+		setup.triangleId = triangleId;
+
+		for (int i = 0; i < 3; i++) setup.depths[i] = vertices[i].z;
+		setup.minDepth = std::min({ v0.z, v1.z, v2.z });
+
+		setup.bounds.left = std::max((int)std::floor(std::min({ v0.x, v1.x, v2.x })), 0);
+		setup.bounds.top = std::max((int)std::floor(std::min({ v0.y, v1.y, v2.y })), 0);
+		setup.bounds.right = std::min((int)std::ceil(std::max({ v0.x, v1.x, v2.x })), width);
+		setup.bounds.bottom = std::min((int)std::ceil(std::max({ v0.y, v1.y, v2.y })), height);
+
+		return setup.bounds.left < setup.bounds.right && setup.bounds.top < setup.bounds.bottom;
+	}
+
+	// Edge function value at the center of pixel (px, py)
+	static inline long long EvaluateEdge(const TriangleSetup& setup, int i, int px, int py)
+	{
+		const int a = (i + 1) % 3;
+		return setup.stepX[i] * (px * SubpixelScale + SubpixelScale / 2 - setup.x[a]) + setup.stepY[i] * (py * SubpixelScale + SubpixelScale / 2 - setup.y[a]);
+	}
+
+	// Resolves a triangle id: scene polygons come first, clipped polygons of the same setup task after them
+	static inline void GetFragmentInputs(const Obj& obj
+		, const std::vector<glm::vec4>& cameraSpaceVertices
+		, const std::vector<glm::vec3>& cameraSpaceNormals
+		, const std::vector<glm::vec4>& cameraSpaceTangents
+		, const std::vector<FragmentInputs>& clippedInputs
+		, const TriangleSetup& setup
+		, FragmentInputs& inputs)
+	{
+		const int triangleId = setup.triangleId;
+		const int polygonsCount = (int)obj.polygons.size();
+		if (triangleId >= polygonsCount)
+		{
+			inputs = clippedInputs[triangleId - polygonsCount];
 		}
+		else
+		{
+			const glm::ivec3 verticesIndices = obj.polygons.verticesIndices[triangleId];
+			const glm::ivec3 textureIndices = obj.polygons.textureIndices[triangleId];
+			const glm::ivec3 normalsIndices = obj.polygons.normalsIndices[triangleId];
+			const glm::ivec3 tangentsIndices = obj.polygons.tangentsIndices[triangleId];
 
-		// v0 = A
-		// v1 = B
-		// v2 = C
-		const int ABx = v1x - v0x;
-		const int ACx = v2x - v0x;
-		const int ABy = v1y - v0y;
-		const int ACy = v2y - v0y;
-
-		int total_height = v2y - v0y;
-		for (int i = 0; i < total_height; i++) {
-			bool second_half = i > v1y - v0y || v1y == v0y;
-			int segment_height = second_half ? v2y - v1y : v1y - v0y;
-			float alpha = (float)i / total_height;
-			float beta = (float)(i - (second_half ? v1y - v0y : 0)) / segment_height;
-			int x1 = v0x + (v2x - v0x) * alpha;
-			int x2 = second_half ? v1x + (v2x - v1x) * beta : v0x + (v1x - v0x) * beta;
-			float z1 = v0z + (v2z - v0z) * alpha;
-			float z2 = second_half ? v1z + (v2z - v1z) * beta : v0z + (v1z - v0z) * beta;
-			if (x1 > x2)
+			for (int i = 0; i < 3; i++)
 			{
-				std::swap(x1, x2);
-				std::swap(z1, z2);
+				inputs.positions[i] = cameraSpaceVertices[verticesIndices[i]];
+				inputs.textureCoords[i] = obj.textureCoords[textureIndices[i]];
+				inputs.normals[i] = cameraSpaceNormals[normalsIndices[i]];
+				inputs.tangents[i] = cameraSpaceTangents[tangentsIndices[i]];
+				inputs.w[i] = -inputs.positions[i].z;
 			}
-			if (x1 < 0) x1 = 0;
-			if (x2 < 0) x2 = 0;
-			if (x1 >= width) x1 = width - 1;
-			if (x2 >= width) x2 = width - 1;
-			if (((x1 == x2) && (x1 == 0)) || ((x1 == x2) && (x1 == width - 1))) continue;
-			if (((v0y + i) < 0) || ((v0y + i) >= height)) continue;
-
-			const int y = v0y + i;
-			const int yMulWidth = y * width;
-			const int PAy = v0y - y;
-			auto Zinc = (z2 - z1) / (float)(x2 - x1 + 1);
-			float z = z1;
-
-			COLORREF color;
-
-			for (int x = x1; x != x2; x++)
-			{
-				if (zBuffer[yMulWidth + x] > z)
-				{
-					zBuffer[yMulWidth + x] = z;
+		}
+
+		const float scale = SubpixelScale * setup.invArea;
+		inputs.barycentricDx = glm::vec3(setup.stepX[0], setup.stepX[1], setup.stepX[2]) * scale;
+		inputs.barycentricDy = glm::vec3(setup.stepY[0], setup.stepY[1], setup.stepY[2]) * scale;
+	}
+
+	// Screen space derivatives of the perspective correct texture coordinates at one fragment.
+	// The weights are b_i / w_i normalized by their sum, differentiated with the quotient rule.
+	static inline void GetTextureDerivatives(const FragmentInputs& inputs, const glm::vec3& barycentric, glm::vec2& dx, glm::vec2& dy)
+	{
+		const glm::vec3 invW(1.0f / inputs.w[0], 1.0f / inputs.w[1], 1.0f / inputs.w[2]);
+		const glm::vec3 weights = barycentric * invW;
+		const float invSum = 1.0f / (weights.x + weights.y + weights.z);
+		const glm::vec3 corrected = weights * invSum;
+
+		const glm::vec3 weightsDx = inputs.barycentricDx * invW;
+		const glm::vec3 weightsDy = inputs.barycentricDy * invW;
+		const glm::vec3 correctedDx = (weightsDx - corrected * (weightsDx.x + weightsDx.y + weightsDx.z)) * invSum;
+		const glm::vec3 correctedDy = (weightsDy - corrected * (weightsDy.x + weightsDy.y + weightsDy.z)) * invSum;
+
+		const glm::vec3* uv = inputs.textureCoords;
+		dx = correctedDx.x * glm::vec2(uv[0]) + correctedDx.y * glm::vec2(uv[1]) + correctedDx.z * glm::vec2(uv[2]);
+		dy = correctedDy.x * glm::vec2(uv[0]) + correctedDy.y * glm::vec2(uv[1]) + correctedDy.z * glm::vec2(uv[2]);
+	}
+
+	static inline Color ShadeFragment(const FragmentInputs& inputs, const glm::vec3& barycentric, const ShadingConstants& constants)
+	{
+		// Perspective correct weights
+		glm::vec3 barycentricCorrected = glm::vec3(barycentric.x / inputs.w[0], barycentric.y / inputs.w[1], barycentric.z / inputs.w[2]);
+		float sum = barycentricCorrected.x + barycentricCorrected.y + barycentricCorrected.z;
+		barycentricCorrected /= sum;
+
+		glm::vec4 v = barycentricCorrected.x * inputs.positions[0] + barycentricCorrected.y * inputs.positions[1] + barycentricCorrected.z * inputs.positions[2];
+
+		glm::vec3 uv = barycentricCorrected.x * inputs.textureCoords[0] + barycentricCorrected.y * inputs.textureCoords[1] + barycentricCorrected.z * inputs.textureCoords[2];
+		const float u = std::clamp(uv.x, 0.0f, 1.0f);
+		const float t = std::clamp(uv.y, 0.0f, 1.0f);
+
+		glm::vec2 dx, dy;
+		GetTextureDerivatives(inputs, barycentric, dx, dy);
 
-					{					
-						glm::vec3 crs = glm::cross(glm::vec3(ACx, ABx, v0x - x), glm::vec3(ACy, ABy, PAy));					
-						glm::vec3 barycentric(1.0f - (crs.x + crs.y) / crs.z, crs.y / crs.z, crs.x / crs.z);
+		// Tangent frame, the handedness is taken per polygon
+		const glm::vec3 normal = barycentricCorrected.x * inputs.normals[0] + barycentricCorrected.y * inputs.normals[1] + barycentricCorrected.z * inputs.normals[2];
+		const glm::vec3 tangent = barycentricCorrected.x * glm::vec3(inputs.tangents[0]) + barycentricCorrected.y * glm::vec3(inputs.tangents[1]) + barycentricCorrected.z * glm::vec3(inputs.tangents[2]);
+		const glm::vec3 bitangent = glm::cross(normal, tangent) * inputs.tangents[0].w;
+
+		const glm::vec3 mapNormal = GetNormalFromMap(u, t);
+		const glm::vec3 shadingNormal = glm::normalize(tangent * mapNormal.x + bitangent * mapNormal.y + normal * mapNormal.z);
+
+		const TextureFilter filter = constants.textureFilter;
+		return GetPhongColor(v, shadingNormal, constants.lightSource, GetRgbFromMap(diffuseMap, u, t, dx, dy, filter), GetSpecularFromMap(specularMap, u, t, dx, dy, filter));
+	}
+
+	// Half-space rasterizer: edge functions are evaluated in fixed point at pixel centers and stepped
+	// incrementally, coverage is first decided for whole BlockSize x BlockSize blocks.
+	// Forward mode shades depth-tested fragments right away, deferred mode only stores the draw list
+	// index in the visibility buffer and leaves shading to ResolveTiles. Depths are keys, see DepthTraits.
+	template <bool Deferred, DepthFormat Format>
+	static inline void RasterizeTriangle(Buffer& buffer, typename DepthTraits<Format>::Type* zBuffer, HiZBuffer& hiZBuffer, int* visibilityBuffer, const TriangleSetup& setup, const FragmentInputs& inputs, const ShadingConstants& constants, int drawIndex, const Tile& tile)
+	{
+		const int tileX = tile.left / TileSize;
+		const int tileY = tile.top / TileSize;
+		const float minDepth = setup.minDepth;
+		const auto& depths = setup.depths;
+
+		// Whole polygon is behind everything already drawn in this tile
+		if (minDepth >= hiZBuffer.GetTileMax(tileX, tileY)) return;
+
+		const int left = std::max(setup.bounds.left, tile.left);
+		const int top = std::max(setup.bounds.top, tile.top);
+		const int right = std::min(setup.bounds.right, tile.right);
+		const int bottom = std::min(setup.bounds.bottom, tile.bottom);
+		if (left >= right || top >= bottom) return;
+
+		const auto& stepX = setup.stepX;
+		const auto& stepY = setup.stepY;
+		const auto& threshold = setup.threshold;
+		const float invArea = setup.invArea;
+
+		FragmentBatch batch;
+		batch.count = 0;
+
+		// Depth is linear in screen space, its per pixel steps give depth bounds for a block
+		const float depthStepX = (stepX[0] * depths[0] + stepX[1] * depths[1] + stepX[2] * depths[2]) * SubpixelScale * invArea;
+		const float depthStepY = (stepY[0] * depths[0] + stepY[1] * depths[1] + stepY[2] * depths[2]) * SubpixelScale * invArea;
+		bool tileWritten = false;
+
+		// Blocks are aligned to the HiZBuffer grid and clipped to the polygon bounds
+		for (int gridTop = top - top % BlockSize; gridTop < bottom; gridTop += BlockSize)
+		{
+			const int blockTop = std::max(gridTop, top);
+			const int blockBottom = std::min(gridTop + BlockSize, bottom);
 
-						//if (barycentric.y < 0 || barycentric.z < 0) continue;
+			for (int gridLeft = left - left % BlockSize; gridLeft < right; gridLeft += BlockSize)
+			{
+				const int blockLeft = std::max(gridLeft, left);
+				const int blockRight = std::min(gridLeft + BlockSize, right);
+				const long long spanX = (blockRight - blockLeft - 1) * SubpixelScale;
+				const long long spanY = (blockBottom - blockTop - 1) * SubpixelScale;
+
+				long long row[3];
+				bool outside = false;
+				bool covered = true;
+				for (int i = 0; i < 3; i++)
+				{
+					row[i] = EvaluateEdge(setup, i, blockLeft, blockTop);
+
+					// Edge functions are linear, so their extremes over a block are at its corners
+					const long long dx = stepX[i] * spanX;
+					const long long dy = stepY[i] * spanY;
+					const long long maxValue = row[i] + std::max(dx, 0LL) + std::max(dy, 0LL);
+					const long long minValue = row[i] + std::min(dx, 0LL) + std::min(dy, 0LL);
+					outside |= maxValue < threshold[i];
+					covered &= minValue >= threshold[i];
+				}
+				if (outside) continue;
 
-						glm::vec3 normal = glm::normalize(barycentric.x * *nA + barycentric.y * *nB + barycentric.z * *nC);
-						glm::vec4 v = barycentric.x * *a + barycentric.y * *b + barycentric.z * *c;						
+				// Nearest depth of the polygon's plane over the block, never nearer than its nearest vertex.
+				// The small bias keeps float rounding from rejecting fragments that would pass.
+				const float cornerDepth = (row[0] * depths[0] + row[1] * depths[1] + row[2] * depths[2]) * invArea;
+				const float planeMinDepth = cornerDepth + std::min(depthStepX * (blockRight - blockLeft - 1), 0.0f) + std::min(depthStepY * (blockBottom - blockTop - 1), 0.0f);
+				if (std::max(minDepth, planeMinDepth) - HiZBias >= hiZBuffer.GetBlockMax(gridLeft / BlockSize, gridTop / BlockSize)) continue;
 
-						glm::vec3 barycentricCorrected = glm::vec3(barycentric.x / v0z, barycentric.y / v1z, barycentric.z / v2z);
-						float sum = barycentricCorrected.x + barycentricCorrected.y + barycentricCorrected.z;
-						barycentricCorrected.x /= sum;
-						barycentricCorrected.y /= sum;
-						barycentricCorrected.z /= sum;
+				bool blockWritten = false;
 
-						glm::vec3 uv = barycentricCorrected.x * txc0 + barycentricCorrected.y * txc1 + barycentricCorrected.z * txc2;
-						COLORREF clr = GetRgbFromMap(diffuseMap, std::clamp(uv.x, 0.0f, 1.0f) , std::clamp(uv.y, 0.0f, 1.0f));
-						normal = GetNormalFromMap(std::clamp(uv.x, 0.0f, 1.0f), std::clamp(uv.y, 0.0f, 1.0f));
-						//clr = RGB(255, 255, 255);
+				for (int py = blockTop; py < blockBottom; py++)
+				{
+					long long w0 = row[0], w1 = row[1], w2 = row[2];
+					const int yMulWidth = py * width;
 
+					for (int px = blockLeft; px < blockRight; px++)
+					{
+						if (covered || (w0 >= threshold[0] && w1 >= threshold[1] && w2 >= threshold[2]))
 						{
-						//COLORREF c0 = GetRgbFromMap(diffuseMap, txc0.x, txc0.y);
-						//COLORREF c1 = GetRgbFromMap(diffuseMap, txc1.x, txc1.y);
-						//COLORREF c2 = GetRgbFromMap(diffuseMap, txc2.x, txc2.y);
-						//COLORREF avg = RGB(
-						//	(GetRValue(c0) + GetRValue(c1) + GetRValue(c2)) / 3.0f,
-						//	(GetGValue(c0) + GetGValue(c1) + GetGValue(c2)) / 3.0f,
-						//	(GetBValue(c0) + GetBValue(c1) + GetBValue(c2)) / 3.0f
-						//);
+							const glm::vec3 barycentric(w0 * invArea, w1 * invArea, w2 * invArea);
+							const auto z = DepthTraits<Format>::Encode(barycentric.x * depths[0] + barycentric.y * depths[1] + barycentric.z * depths[2]);
+
+							if (zBuffer[yMulWidth + px] > z)
+							{
+								zBuffer[yMulWidth + px] = z;
+								blockWritten = true;
+
+								if constexpr (Deferred)
+								{
+									visibilityBuffer[yMulWidth + px] = drawIndex;
+								}
+								else
+								{
+									batch.pixels[batch.count] = buffer.GetIndex(px, py);
+									batch.barycentric[0][batch.count] = barycentric.x;
+									batch.barycentric[1][batch.count] = barycentric.y;
+									batch.barycentric[2][batch.count] = barycentric.z;
+
+									if (++batch.count == FragmentBatchSize)
+									{
+										shadeFragments(buffer, inputs, batch, constants);
+										batch.count = 0;
+									}
+								}
+							}
 						}
 
-						color = GetPhongColor(v, normal, lightSource, clr, GetSpecularFromMap(specularMap, std::clamp(uv.x, 0.0f, 1.0f), std::clamp(uv.y, 0.0f, 1.0f)));
+						w0 += stepX[0] * SubpixelScale;
+						w1 += stepX[1] * SubpixelScale;
+						w2 += stepX[2] * SubpixelScale;
 					}
 
-					buffer.SetPixel(x, y, color);
+					row[0] += stepY[0] * SubpixelScale;
+					row[1] += stepY[1] * SubpixelScale;
+					row[2] += stepY[2] * SubpixelScale;
+				}
+
+				if (blockWritten)
+				{
+					hiZBuffer.UpdateBlock<Format>(zBuffer, gridLeft / BlockSize, gridTop / BlockSize);
+					tileWritten = true;
 				}
-				z += Zinc;
 			}
 		}
+
+		if (tileWritten)
+		{
+			hiZBuffer.UpdateTile(tileX, tileY);
+		}
+
+		if (batch.count != 0)
+		{
+			shadeFragments(buffer, inputs, batch, constants);
+		}
 	}
 
-	static inline COLORREF GetPhongColor(const glm::vec4& v, const glm::vec3& normal, const LightSource& lightSource, const COLORREF& color, glm::vec3 specular)
+	static inline Color GetPhongColor(const glm::vec4& v, const glm::vec3& normal, const LightSource& lightSource, const Color& color, glm::vec3 specular)
 	{
 		float ambientStrength = 0.1;
 
@@ -373,11 +794,11 @@ private:
 		g += lightSource.color.y * spec * specular.y;
 		b += lightSource.color.z * spec * specular.z;
 
-		r = std::min(r * GetRValue(color), 255.0f);
-		g = std::min(g * GetGValue(color), 255.0f);
-		b = std::min(b * GetBValue(color), 255.0f);
+		r = std::min(r * GetRed(color), 255.0f);
+		g = std::min(g * GetGreen(color), 255.0f);
+		b = std::min(b * GetBlue(color), 255.0f);
 
-		return RGB(b, g, r);
+		return MakeRgb(b, g, r);
 	}
 };
 
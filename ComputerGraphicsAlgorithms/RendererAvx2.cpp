@@ -0,0 +1,357 @@
+#include "Renderer.h"
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC accepts AVX2 intrinsics in any function, no per-function target is needed
+#define CGA_TARGET_AVX2
+#else
+// Only the functions below are compiled for AVX2, so the binary still runs on older CPUs
+#define CGA_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+namespace cga
+{
+
+namespace
+{
+
+CGA_TARGET_AVX2 inline __m256 Dot(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+{
+	return _mm256_fmadd_ps(ax, bx, _mm256_fmadd_ps(ay, by, _mm256_mul_ps(az, bz)));
+}
+
+CGA_TARGET_AVX2 inline void Normalize(__m256& x, __m256& y, __m256& z)
+{
+	const __m256 length = _mm256_sqrt_ps(Dot(x, y, z, x, y, z));
+	x = _mm256_div_ps(x, length);
+	y = _mm256_div_ps(y, length);
+	z = _mm256_div_ps(z, length);
+}
+
+CGA_TARGET_AVX2 inline __m256 Interpolate(const __m256 weights[3], float a, float b, float c)
+{
+	return _mm256_fmadd_ps(weights[0], _mm256_set1_ps(a), _mm256_fmadd_ps(weights[1], _mm256_set1_ps(b), _mm256_mul_ps(weights[2], _mm256_set1_ps(c))));
+}
+
+CGA_TARGET_AVX2 inline __m256 GetChannel(__m256i texels, int channel)
+{
+	return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, channel * 8), _mm256_set1_epi32(0xFF)));
+}
+
+// log2 for positive normal floats: exponent plus a polynomial fit of the mantissa, error below 1e-4
+CGA_TARGET_AVX2 inline __m256 Log2(__m256 x)
+{
+	const __m256i bits = _mm256_castps_si256(x);
+	const __m256 exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+	const __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F800000)));
+
+	__m256 p = _mm256_set1_ps(-0.056570851f);
+	p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(0.44717955f));
+	p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-1.4699568f));
+	p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(2.8212026f));
+	p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-1.7417939f));
+	return _mm256_add_ps(exponent, p);
+}
+
+// Texture::GetLod
+CGA_TARGET_AVX2 inline __m256 GetLod(const Texture& texture, __m256 dudx, __m256 dvdx, __m256 dudy, __m256 dvdy)
+{
+	const __m256 width = _mm256_set1_ps((float)texture.GetWidth());
+	const __m256 height = _mm256_set1_ps((float)texture.GetHeight());
+	dudx = _mm256_mul_ps(dudx, width);
+	dvdx = _mm256_mul_ps(dvdx, height);
+	dudy = _mm256_mul_ps(dudy, width);
+	dvdy = _mm256_mul_ps(dvdy, height);
+
+	const __m256 rho = _mm256_max_ps(_mm256_fmadd_ps(dudx, dudx, _mm256_mul_ps(dvdx, dvdx)), _mm256_fmadd_ps(dudy, dudy, _mm256_mul_ps(dvdy, dvdy)));
+	const __m256 positive = _mm256_cmp_ps(rho, _mm256_set1_ps(1e-30f), _CMP_GT_OQ);
+	return _mm256_and_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), Log2(_mm256_max_ps(rho, _mm256_set1_ps(1e-30f)))), positive);
+}
+
+// Texture::GetAddress for 8 texels, x and y already clamped to their level
+CGA_TARGET_AVX2 inline __m256i GetColumnAddresses(__m256i x)
+{
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i morton = _mm256_or_si256(_mm256_and_si256(x, one), _mm256_or_si256(
+		_mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(2)), 1),
+		_mm256_slli_epi32(_mm256_and_si256(x, _mm256_set1_epi32(4)), 2)));
+	return _mm256_add_epi32(_mm256_slli_epi32(_mm256_srli_epi32(x, 3), 6), morton);
+}
+
+CGA_TARGET_AVX2 inline __m256i GetRowAddresses(__m256i y, __m256i tilesX, __m256i offset)
+{
+	const __m256i morton = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(1)), 1), _mm256_or_si256(
+		_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(2)), 2),
+		_mm256_slli_epi32(_mm256_and_si256(y, _mm256_set1_epi32(4)), 3)));
+	return _mm256_add_epi32(_mm256_add_epi32(offset, _mm256_slli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, 3), tilesX), 6)), morton);
+}
+
+// Same texels as GetNormalFromMap: point sampling of the full size level, v flipped, coordinates already clamped to [0, 1]
+CGA_TARGET_AVX2 inline __m256i FetchNormals(const Texture& map, __m256 u, __m256 v)
+{
+	const int width = map.GetWidth();
+	const int height = map.GetHeight();
+	const __m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(u, _mm256_set1_ps((float)(width - 1)))), _mm256_set1_epi32(width - 1));
+	const __m256i j = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), v), _mm256_set1_ps((float)(height - 1)))), _mm256_set1_epi32(height - 1));
+
+	const __m256i addresses = _mm256_add_epi32(GetRowAddresses(j, _mm256_set1_epi32(map.GetLevelTilesX()[0]), _mm256_set1_epi32(map.GetLevelOffsets()[0])), GetColumnAddresses(i));
+	return _mm256_i32gather_epi32(reinterpret_cast<const int*>(map.GetTexels()), addresses, 4);
+}
+
+// Texture::SampleBilinear, only the red and green channels are used by the shading
+CGA_TARGET_AVX2 inline void SampleBilinear(const Texture& texture, __m256i level, __m256 u, __m256 v, __m256& red, __m256& green)
+{
+	const __m256i width = _mm256_i32gather_epi32(texture.GetLevelWidths(), level, 4);
+	const __m256i height = _mm256_i32gather_epi32(texture.GetLevelHeights(), level, 4);
+	const __m256i tilesX = _mm256_i32gather_epi32(texture.GetLevelTilesX(), level, 4);
+	const __m256i offset = _mm256_i32gather_epi32(texture.GetLevelOffsets(), level, 4);
+
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 x = _mm256_fmsub_ps(u, _mm256_cvtepi32_ps(width), half);
+	const __m256 y = _mm256_fmsub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), v), _mm256_cvtepi32_ps(height), half);
+	const __m256 x0f = _mm256_floor_ps(x);
+	const __m256 y0f = _mm256_floor_ps(y);
+	const __m256 fx = _mm256_sub_ps(x, x0f);
+	const __m256 fy = _mm256_sub_ps(y, y0f);
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i maxX = _mm256_sub_epi32(width, one);
+	const __m256i maxY = _mm256_sub_epi32(height, one);
+	const __m256i x0 = _mm256_cvtps_epi32(x0f);
+	const __m256i y0 = _mm256_cvtps_epi32(y0f);
+
+	const __m256i column0 = GetColumnAddresses(_mm256_min_epi32(_mm256_max_epi32(x0, zero), maxX));
+	const __m256i column1 = GetColumnAddresses(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(x0, one), zero), maxX));
+	const __m256i row0 = GetRowAddresses(_mm256_min_epi32(_mm256_max_epi32(y0, zero), maxY), tilesX, offset);
+	const __m256i row1 = GetRowAddresses(_mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y0, one), zero), maxY), tilesX, offset);
+
+	const int* texels = reinterpret_cast<const int*>(texture.GetTexels());
+	const __m256i texel00 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(row0, column0), 4);
+	const __m256i texel01 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(row0, column1), 4);
+	const __m256i texel10 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(row1, column0), 4);
+	const __m256i texel11 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(row1, column1), 4);
+
+	__m256 channels[2];
+	for (int channel = 0; channel < 2; channel++)
+	{
+		const __m256 c00 = GetChannel(texel00, channel);
+		const __m256 c10 = GetChannel(texel10, channel);
+		const __m256 top = _mm256_fmadd_ps(fx, _mm256_sub_ps(GetChannel(texel01, channel), c00), c00);
+		const __m256 bottom = _mm256_fmadd_ps(fx, _mm256_sub_ps(GetChannel(texel11, channel), c10), c10);
+		channels[channel] = _mm256_fmadd_ps(fy, _mm256_sub_ps(bottom, top), top);
+	}
+	red = channels[0];
+	green = channels[1];
+}
+
+// Texture::Sample
+CGA_TARGET_AVX2 inline void SampleTexture(const Texture& texture, __m256 u, __m256 v, __m256 lod, TextureFilter filter, __m256& red, __m256& green)
+{
+	if (filter == FilterPoint)
+	{
+		const int width = texture.GetWidth();
+		const int height = texture.GetHeight();
+		const __m256i x = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(u, _mm256_set1_ps((float)width))), _mm256_set1_epi32(width - 1));
+		const __m256i y = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), v), _mm256_set1_ps((float)height))), _mm256_set1_epi32(height - 1));
+		const __m256i addresses = _mm256_add_epi32(GetRowAddresses(y, _mm256_set1_epi32(texture.GetLevelTilesX()[0]), _mm256_setzero_si256()), GetColumnAddresses(x));
+		const __m256i texels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(texture.GetTexels()), addresses, 4);
+		red = GetChannel(texels, 0);
+		green = GetChannel(texels, 1);
+		return;
+	}
+
+	lod = _mm256_min_ps(_mm256_max_ps(lod, _mm256_setzero_ps()), _mm256_set1_ps((float)(texture.GetLevels() - 1)));
+
+	if (filter == FilterBilinear)
+	{
+		SampleBilinear(texture, _mm256_cvttps_epi32(_mm256_add_ps(lod, _mm256_set1_ps(0.5f))), u, v, red, green);
+		return;
+	}
+
+	const __m256 level0 = _mm256_floor_ps(lod);
+	const __m256 fraction = _mm256_sub_ps(lod, level0);
+	const __m256i level = _mm256_cvttps_epi32(level0);
+	const __m256i nextLevel = _mm256_min_epi32(_mm256_add_epi32(level, _mm256_set1_epi32(1)), _mm256_set1_epi32(texture.GetLevels() - 1));
+
+	__m256 nextRed, nextGreen;
+	SampleBilinear(texture, level, u, v, red, green);
+	SampleBilinear(texture, nextLevel, u, v, nextRed, nextGreen);
+	red = _mm256_fmadd_ps(fraction, _mm256_sub_ps(nextRed, red), red);
+	green = _mm256_fmadd_ps(fraction, _mm256_sub_ps(nextGreen, green), green);
+}
+
+}
+
+bool Renderer::IsAvx2Supported()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	__cpuid(info, 1);
+	const bool fma = (info[2] & (1 << 12)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!fma || !osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+// 8-wide version of ShadeFragment + GetPhongColor, lanes past batch.count repeat the first fragment
+CGA_TARGET_AVX2 void Renderer::ShadeFragmentsAvx2(Buffer& buffer, const FragmentInputs& inputs, const FragmentBatch& batch, const ShadingConstants& constants)
+{
+	const LightSource& lightSource = constants.lightSource;
+
+	alignas(32) float weights[3][FragmentBatchSize];
+	for (int k = 0; k < 3; k++)
+	{
+		for (int i = 0; i < FragmentBatchSize; i++)
+		{
+			weights[k][i] = batch.barycentric[k][i < batch.count ? i : 0];
+		}
+	}
+
+	__m256 barycentric[3] = { _mm256_load_ps(weights[0]), _mm256_load_ps(weights[1]), _mm256_load_ps(weights[2]) };
+
+	// Perspective correct weights
+	for (int k = 0; k < 3; k++)
+	{
+		barycentric[k] = _mm256_div_ps(barycentric[k], _mm256_set1_ps(inputs.w[k]));
+	}
+	const __m256 sum = _mm256_add_ps(_mm256_add_ps(barycentric[0], barycentric[1]), barycentric[2]);
+	for (int k = 0; k < 3; k++)
+	{
+		barycentric[k] = _mm256_div_ps(barycentric[k], sum);
+	}
+
+	// Their screen space derivatives, same as GetTextureDerivatives. The unnormalized steps are constant per polygon.
+	float weightsDx[3], weightsDy[3];
+	for (int k = 0; k < 3; k++)
+	{
+		weightsDx[k] = inputs.barycentricDx[k] / inputs.w[k];
+		weightsDy[k] = inputs.barycentricDy[k] / inputs.w[k];
+	}
+	const __m256 invSum = _mm256_div_ps(_mm256_set1_ps(1.0f), sum);
+	const __m256 sumDx = _mm256_set1_ps(weightsDx[0] + weightsDx[1] + weightsDx[2]);
+	const __m256 sumDy = _mm256_set1_ps(weightsDy[0] + weightsDy[1] + weightsDy[2]);
+	__m256 barycentricDx[3], barycentricDy[3];
+	for (int k = 0; k < 3; k++)
+	{
+		barycentricDx[k] = _mm256_mul_ps(_mm256_fnmadd_ps(barycentric[k], sumDx, _mm256_set1_ps(weightsDx[k])), invSum);
+		barycentricDy[k] = _mm256_mul_ps(_mm256_fnmadd_ps(barycentric[k], sumDy, _mm256_set1_ps(weightsDy[k])), invSum);
+	}
+
+	// Camera space position
+	const glm::vec4& a = inputs.positions[0];
+	const glm::vec4& b = inputs.positions[1];
+	const glm::vec4& c = inputs.positions[2];
+	const __m256 vx = Interpolate(barycentric, a.x, b.x, c.x);
+	const __m256 vy = Interpolate(barycentric, a.y, b.y, c.y);
+	const __m256 vz = Interpolate(barycentric, a.z, b.z, c.z);
+
+	// Texture coordinates
+	const glm::vec3* uv = inputs.textureCoords;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 u = _mm256_min_ps(_mm256_max_ps(Interpolate(barycentric, uv[0].x, uv[1].x, uv[2].x), zero), one);
+	const __m256 v = _mm256_min_ps(_mm256_max_ps(Interpolate(barycentric, uv[0].y, uv[1].y, uv[2].y), zero), one);
+
+	const __m256 dudx = Interpolate(barycentricDx, uv[0].x, uv[1].x, uv[2].x);
+	const __m256 dvdx = Interpolate(barycentricDx, uv[0].y, uv[1].y, uv[2].y);
+	const __m256 dudy = Interpolate(barycentricDy, uv[0].x, uv[1].x, uv[2].x);
+	const __m256 dvdy = Interpolate(barycentricDy, uv[0].y, uv[1].y, uv[2].y);
+
+	// Texture fetches
+	__m256 diffuseR, diffuseG, specularR, specularG;
+	SampleTexture(diffuseMap, u, v, GetLod(diffuseMap, dudx, dvdx, dudy, dvdy), constants.textureFilter, diffuseR, diffuseG);
+	SampleTexture(specularMap, u, v, GetLod(specularMap, dudx, dvdx, dudy, dvdy), constants.textureFilter, specularR, specularG);
+
+	// Tangent space normal
+	const __m256i normalTexels = FetchNormals(normalMap, u, v);
+	const __m256 two = _mm256_set1_ps(2.0f / 255.0f);
+	const __m256 mapX = _mm256_fmsub_ps(GetChannel(normalTexels, 0), two, one);
+	const __m256 mapY = _mm256_fmsub_ps(GetChannel(normalTexels, 1), two, one);
+	const __m256 mapZ = _mm256_sqrt_ps(_mm256_max_ps(_mm256_fnmadd_ps(mapY, mapY, _mm256_fnmadd_ps(mapX, mapX, one)), zero));
+
+	// Tangent frame, the handedness is taken per polygon like ShadeFragment does
+	const glm::vec3* n = inputs.normals;
+	const glm::vec4* t = inputs.tangents;
+	const __m256 normalX = Interpolate(barycentric, n[0].x, n[1].x, n[2].x);
+	const __m256 normalY = Interpolate(barycentric, n[0].y, n[1].y, n[2].y);
+	const __m256 normalZ = Interpolate(barycentric, n[0].z, n[1].z, n[2].z);
+	const __m256 tangentX = Interpolate(barycentric, t[0].x, t[1].x, t[2].x);
+	const __m256 tangentY = Interpolate(barycentric, t[0].y, t[1].y, t[2].y);
+	const __m256 tangentZ = Interpolate(barycentric, t[0].z, t[1].z, t[2].z);
+	const __m256 handedness = _mm256_set1_ps(t[0].w);
+	const __m256 bitangentX = _mm256_mul_ps(_mm256_fmsub_ps(normalY, tangentZ, _mm256_mul_ps(normalZ, tangentY)), handedness);
+	const __m256 bitangentY = _mm256_mul_ps(_mm256_fmsub_ps(normalZ, tangentX, _mm256_mul_ps(normalX, tangentZ)), handedness);
+	const __m256 bitangentZ = _mm256_mul_ps(_mm256_fmsub_ps(normalX, tangentY, _mm256_mul_ps(normalY, tangentX)), handedness);
+
+	__m256 nx = _mm256_fmadd_ps(tangentX, mapX, _mm256_fmadd_ps(bitangentX, mapY, _mm256_mul_ps(normalX, mapZ)));
+	__m256 ny = _mm256_fmadd_ps(tangentY, mapX, _mm256_fmadd_ps(bitangentY, mapY, _mm256_mul_ps(normalY, mapZ)));
+	__m256 nz = _mm256_fmadd_ps(tangentZ, mapX, _mm256_fmadd_ps(bitangentZ, mapY, _mm256_mul_ps(normalZ, mapZ)));
+	Normalize(nx, ny, nz);
+
+	// Phong
+	__m256 lx = _mm256_sub_ps(_mm256_set1_ps(lightSource.position.x), vx);
+	__m256 ly = _mm256_sub_ps(_mm256_set1_ps(lightSource.position.y), vy);
+	__m256 lz = _mm256_sub_ps(_mm256_set1_ps(lightSource.position.z), vz);
+	Normalize(lx, ly, lz);
+
+	const __m256 lightDotNormal = Dot(lx, ly, lz, nx, ny, nz);
+	const __m256 diff = _mm256_max_ps(lightDotNormal, zero);
+
+	__m256 viewX = _mm256_sub_ps(zero, vx);
+	__m256 viewY = _mm256_sub_ps(zero, vy);
+	__m256 viewZ = _mm256_sub_ps(zero, vz);
+	Normalize(viewX, viewY, viewZ);
+
+	// reflect(-lightDir, normal) = 2 * dot(normal, lightDir) * normal - lightDir
+	const __m256 twiceDot = _mm256_add_ps(lightDotNormal, lightDotNormal);
+	const __m256 rx = _mm256_fmsub_ps(twiceDot, nx, lx);
+	const __m256 ry = _mm256_fmsub_ps(twiceDot, ny, ly);
+	const __m256 rz = _mm256_fmsub_ps(twiceDot, nz, lz);
+
+	__m256 spec = _mm256_max_ps(Dot(viewX, viewY, viewZ, rx, ry, rz), zero);
+	for (int i = 0; i < 7; i++)
+	{
+		spec = _mm256_mul_ps(spec, spec); // pow(spec, 128)
+	}
+
+	const __m256 inv255 = _mm256_set1_ps(1.0f / 255.0f);
+	specularR = _mm256_mul_ps(specularR, inv255);
+	specularG = _mm256_mul_ps(specularG, inv255);
+
+	const __m256 ambientAndDiffuse = _mm256_add_ps(_mm256_set1_ps(0.1f), diff);
+	const __m256 lightR = _mm256_mul_ps(_mm256_set1_ps(lightSource.color.x), _mm256_fmadd_ps(spec, specularR, ambientAndDiffuse));
+	const __m256 lightG = _mm256_mul_ps(_mm256_set1_ps(lightSource.color.y), _mm256_fmadd_ps(spec, specularG, ambientAndDiffuse));
+	const __m256 lightB = _mm256_mul_ps(_mm256_set1_ps(lightSource.color.z), _mm256_fmadd_ps(spec, specularG, ambientAndDiffuse));
+
+	// GetRgbFromMap rounds the filtered texel and takes blue from the green channel as well
+	const __m256 max = _mm256_set1_ps(255.0f);
+	diffuseR = _mm256_floor_ps(_mm256_add_ps(diffuseR, _mm256_set1_ps(0.5f)));
+	diffuseG = _mm256_floor_ps(_mm256_add_ps(diffuseG, _mm256_set1_ps(0.5f)));
+	const __m256i r = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(lightR, diffuseR), max));
+	const __m256i g = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(lightG, diffuseG), max));
+	const __m256i bl = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(lightB, diffuseG), max));
+
+	// Same packing as GetPhongColor: MakeRgb(b, g, r)
+	alignas(32) Color colors[FragmentBatchSize];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(colors), _mm256_or_si256(bl, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(r, 16))));
+
+	Color* pixels = buffer.GetPixels();
+	for (int i = 0; i < batch.count; i++)
+	{
+		pixels[batch.pixels[i]] = colors[i];
+	}
+}
+
+}
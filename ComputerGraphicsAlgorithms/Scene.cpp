@@ -1,11 +1,13 @@
 #include "Scene.h"
 
+#include <utility>
+
 namespace cga
 {
 
 Scene::Scene(Camera aCamera, Obj aObj)
 	: camera(aCamera),
-	obj(aObj)
+	obj(std::move(aObj))
 {
 
 }
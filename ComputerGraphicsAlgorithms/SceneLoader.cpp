@@ -0,0 +1,145 @@
+#include "SceneLoader.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "MeshCache.h"
+#include "MeshletBuilder.h"
+#include "TangentBuilder.h"
+
+namespace cga
+{
+
+namespace
+{
+
+// Rough share of the loading time of each part, for the progress
+const float ProxyShare = 0.1f;
+const float MeshShare = 0.6f;
+const float MapsShare = 0.3f;
+
+}
+
+void SceneLoader::Start(const std::string& objPath, const std::string& mapsPath)
+{
+	if (IsLoading()) abandoned.push_back(std::move(current));
+
+	current.proxy = std::async(std::launch::async, &SceneLoader::LoadProxy, objPath);
+	current.mesh = std::async(std::launch::async, [objPath]() { return MeshCache().Load(objPath); });
+	current.maps = std::async(std::launch::async, &Renderer::LoadMaps, mapsPath);
+}
+
+void SceneLoader::ReleaseAbandoned()
+{
+	auto finished = [](const Load& load)
+	{
+		return (!load.proxy.valid() || IsReady(load.proxy)) && (!load.mesh.valid() || IsReady(load.mesh))
+			&& (!load.maps.valid() || IsReady(load.maps));
+	};
+
+	abandoned.erase(std::remove_if(abandoned.begin(), abandoned.end(), finished), abandoned.end());
+}
+
+bool SceneLoader::IsLoading() const
+{
+	return current.proxy.valid() || current.mesh.valid() || current.maps.valid();
+}
+
+float SceneLoader::GetProgress() const
+{
+	float progress = 0.0f;
+	if (!current.proxy.valid() || IsReady(current.proxy)) progress += ProxyShare;
+	if (!current.mesh.valid() || IsReady(current.mesh)) progress += MeshShare;
+	if (!current.maps.valid() || IsReady(current.maps)) progress += MapsShare;
+	return progress;
+}
+
+bool SceneLoader::IsProxyReady() const
+{
+	return IsReady(current.proxy);
+}
+
+bool SceneLoader::IsMeshReady() const
+{
+	return IsReady(current.mesh);
+}
+
+bool SceneLoader::AreMapsReady() const
+{
+	return IsReady(current.maps);
+}
+
+std::optional<Obj> SceneLoader::TakeProxy()
+{
+	auto result = current.proxy.get();
+
+	// A proxy that comes after its mesh would replace it
+	if (!current.mesh.valid()) return {};
+	return result;
+}
+
+std::optional<Obj> SceneLoader::TakeMesh()
+{
+	return current.mesh.get();
+}
+
+Renderer::Maps SceneLoader::TakeMaps()
+{
+	return current.maps.get();
+}
+
+Obj SceneLoader::CreateBoxProxy(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+	Obj obj;
+
+	// Bit k of the corner index picks the maximum along axis k
+	for (int corner = 0; corner < 8; corner++)
+	{
+		obj.vertices.emplace_back(corner & 1 ? boundsMax.x : boundsMin.x, corner & 2 ? boundsMax.y : boundsMin.y, corner & 4 ? boundsMax.z : boundsMin.z, 1.0f);
+	}
+
+	obj.textureCoords = { glm::vec3(0, 0, 0), glm::vec3(1, 0, 0), glm::vec3(1, 1, 0), glm::vec3(0, 1, 0) };
+
+	// With u and v the next two axes after the face axis, the quad base, +u, +u+v, +v winds counterclockwise
+	// seen from the positive side, faces on the negative side take it backwards
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const int u = 1 << ((axis + 1) % 3);
+		const int v = 1 << ((axis + 2) % 3);
+
+		for (int side = 0; side < 2; side++)
+		{
+			glm::vec3 normal(0.0f);
+			normal[axis] = side ? 1.0f : -1.0f;
+			obj.normals.push_back(normal);
+			const int n = (int)obj.normals.size() - 1;
+
+			const int base = side << axis;
+			glm::ivec4 quad(base, base + u, base + u + v, base + v);
+			glm::ivec4 texture(0, 1, 2, 3);
+			if (!side)
+			{
+				std::swap(quad[1], quad[3]);
+				std::swap(texture[1], texture[3]);
+			}
+
+			obj.polygons.push_back(glm::ivec3(quad[0], quad[1], quad[2]), glm::ivec3(texture[0], texture[1], texture[2]), glm::ivec3(n));
+			obj.polygons.push_back(glm::ivec3(quad[0], quad[2], quad[3]), glm::ivec3(texture[0], texture[2], texture[3]), glm::ivec3(n));
+		}
+	}
+
+	MeshletBuilder().Build(obj);
+	TangentBuilder().Build(obj);
+
+	return obj;
+}
+
+std::optional<Obj> SceneLoader::LoadProxy(const std::string& objPath)
+{
+	glm::vec3 boundsMin, boundsMax;
+	if (!MeshCache().LoadBounds(objPath, boundsMin, boundsMax)) return {};
+
+	return CreateBoxProxy(boundsMin, boundsMax);
+}
+
+}
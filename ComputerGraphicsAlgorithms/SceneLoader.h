@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Obj.h"
+#include "Renderer.h"
+
+namespace cga
+{
+
+// Loads a scene on background tasks so that the window stays responsive. The mesh and the maps load
+// concurrently, and a box over the bounds of the mesh, which come from the mesh cache header or a pass over
+// the positions alone, is ready long before the mesh itself so that there is something to look at.
+// Every result is taken once on the thread that renders, which swaps it in between frames.
+// A new load replaces the one in flight without waiting for it, the old tasks finish in the background.
+class SceneLoader
+{
+public:
+	// A load still running is abandoned, its results are dropped
+	void Start(const std::string& objPath, const std::string& mapsPath);
+
+	// Frees abandoned loads whose tasks have ended, call it regularly
+	void ReleaseAbandoned();
+
+	// True until every result of the last load was taken
+	bool IsLoading() const;
+
+	// Share of the last load that is done, from 0 to 1
+	float GetProgress() const;
+
+	bool IsProxyReady() const;
+	bool IsMeshReady() const;
+	bool AreMapsReady() const;
+
+	// False once the maps were taken
+	inline bool AreMapsPending() const
+	{
+		return current.maps.valid();
+	}
+
+	// Each is valid once after its Is...Ready returned true. The meshes are empty when the file can't be read,
+	// the proxy also when the mesh was taken first.
+	std::optional<Obj> TakeProxy();
+	std::optional<Obj> TakeMesh();
+	Renderer::Maps TakeMaps();
+
+protected:
+	// Six faces with their own normals and texture coordinates, built into meshlets like any other mesh
+	static Obj CreateBoxProxy(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+	static std::optional<Obj> LoadProxy(const std::string& objPath);
+
+	template <typename T>
+	static inline bool IsReady(const std::future<T>& result)
+	{
+		return result.valid() && result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+
+	// Futures from std::async wait for their task when they are destroyed or assigned over
+	struct Load
+	{
+		std::future<std::optional<Obj>> proxy;
+		std::future<std::optional<Obj>> mesh;
+		std::future<Renderer::Maps> maps;
+	};
+
+	Load current;
+
+	// Loads replaced before they finished, kept until their tasks end so that nothing waits for them
+	std::vector<Load> abandoned;
+};
+
+}
@@ -0,0 +1,92 @@
+#include "TangentBuilder.h"
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+
+namespace cga
+{
+
+void TangentBuilder::Build(Obj& obj)
+{
+	auto& polygons = obj.polygons;
+	const int polygonsCount = (int)polygons.size();
+
+	// Corners share a tangent frame when they share the normal and the texture coordinates and their polygons
+	// agree on mirroring, so UV seams and mirrored islands get frames of their own
+	struct Frame
+	{
+		int normal;
+		glm::vec3 tangent;
+		glm::vec3 bitangent;
+	};
+
+	std::vector<Frame> frames;
+	std::unordered_map<std::uint64_t, int> framesByCorner;
+	framesByCorner.reserve(obj.normals.size());
+	polygons.tangentsIndices.resize(polygonsCount);
+
+	// Directions of increasing u and v, summed over the polygons around every frame.
+	// The sums are not normalized per polygon, so larger polygons weigh more.
+	for (int i = 0; i < polygonsCount; i++)
+	{
+		const glm::ivec3 verticesIndices = polygons.verticesIndices[i];
+		const glm::ivec3 textureIndices = polygons.textureIndices[i];
+		const glm::ivec3 normalsIndices = polygons.normalsIndices[i];
+
+		const glm::vec3 p0 = obj.vertices[verticesIndices[0]];
+		const glm::vec3 e1 = glm::vec3(obj.vertices[verticesIndices[1]]) - p0;
+		const glm::vec3 e2 = glm::vec3(obj.vertices[verticesIndices[2]]) - p0;
+
+		const glm::vec2 uv0 = obj.textureCoords[textureIndices[0]];
+		const glm::vec2 duv1 = glm::vec2(obj.textureCoords[textureIndices[1]]) - uv0;
+		const glm::vec2 duv2 = glm::vec2(obj.textureCoords[textureIndices[2]]) - uv0;
+
+		// Degenerate texture mapping adds nothing to its frames
+		const float determinant = duv1.x * duv2.y - duv2.x * duv1.y;
+		const bool degenerate = std::abs(determinant) < 1e-12f;
+
+		const float r = degenerate ? 0.0f : 1.0f / determinant;
+		const glm::vec3 tangent = (e1 * duv2.y - e2 * duv1.y) * r;
+		const glm::vec3 bitangent = (e2 * duv1.x - e1 * duv2.x) * r;
+		const std::uint64_t mirrored = determinant < 0.0f ? 1 : 0;
+
+		for (int k = 0; k < 3; k++)
+		{
+			const std::uint64_t corner = (std::uint64_t)(std::uint32_t)normalsIndices[k] << 32
+				| (std::uint64_t)(std::uint32_t)textureIndices[k] << 1 | mirrored;
+			const auto inserted = framesByCorner.emplace(corner, (int)frames.size());
+			if (inserted.second) frames.push_back({ normalsIndices[k], glm::vec3(0.0f), glm::vec3(0.0f) });
+
+			Frame& frame = frames[inserted.first->second];
+			frame.tangent += tangent;
+			frame.bitangent += bitangent;
+			polygons.tangentsIndices[i][k] = inserted.first->second;
+		}
+	}
+
+	obj.tangents.resize(frames.size());
+
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		const Frame& frame = frames[i];
+		const glm::vec3 normal = glm::normalize(obj.normals[frame.normal]);
+
+		// Gram-Schmidt against the normal
+		glm::vec3 tangent = frame.tangent - normal * glm::dot(normal, frame.tangent);
+		const float length = glm::length(tangent);
+		tangent = length > 1e-12f ? tangent / length : GetPerpendicular(normal);
+
+		// Mirrored texture mapping flips the bitangent
+		const float handedness = glm::dot(glm::cross(normal, tangent), frame.bitangent) < 0.0f ? -1.0f : 1.0f;
+		obj.tangents[i] = glm::vec4(tangent, handedness);
+	}
+}
+
+glm::vec3 TangentBuilder::GetPerpendicular(const glm::vec3& normal)
+{
+	const glm::vec3 axis = std::abs(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	return glm::normalize(glm::cross(axis, normal));
+}
+
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Obj.h"
+
+namespace cga
+{
+
+// Computes tangent frames for sampling tangent space normal maps from the texture coordinates of a mesh.
+// Every distinct normal, texture coordinates and mirroring of the corners gets a frame, see Polygons::tangentsIndices.
+class TangentBuilder
+{
+public:
+	void Build(Obj& obj);
+
+protected:
+	glm::vec3 GetPerpendicular(const glm::vec3& normal);
+};
+
+}
@@ -0,0 +1,105 @@
+#include "Texture.h"
+
+#include <cstring>
+
+namespace cga
+{
+
+void Texture::Create(const unsigned char* rgba, int aWidth, int aHeight)
+{
+	Clear();
+	if (rgba == nullptr || aWidth <= 0 || aHeight <= 0) return;
+
+	// Level sizes are halved and rounded down, the chain ends at 1 x 1
+	int& levels = layout.levels;
+	for (int width = aWidth, height = aHeight; levels < MaxTextureLevels; levels++)
+	{
+		layout.widths[levels] = width;
+		layout.heights[levels] = height;
+		layout.tilesX[levels] = (width + TextureTileSize - 1) / TextureTileSize;
+		layout.offsets[levels] = layout.size;
+
+		const int tilesY = (height + TextureTileSize - 1) / TextureTileSize;
+		layout.size += layout.tilesX[levels] * tilesY * TextureTileSize * TextureTileSize;
+
+		if (width == 1 && height == 1)
+		{
+			levels++;
+			break;
+		}
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+
+	storage.assign(layout.size, 0);
+	texels = storage.data();
+
+	// Every level is built from the previous one in row-major order, then copied into tiles
+	std::vector<std::uint32_t> level(aWidth * aHeight);
+	std::memcpy(level.data(), rgba, level.size() * sizeof(std::uint32_t));
+
+	std::vector<std::uint32_t> next;
+	for (int l = 0; l < levels; l++)
+	{
+		const int width = layout.widths[l];
+		const int height = layout.heights[l];
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				storage[GetAddress(l, x, y)] = level[y * width + x];
+			}
+		}
+
+		if (l + 1 == levels) break;
+
+		// 2 x 2 box filter, odd sizes drop their last row or column
+		const int nextWidth = layout.widths[l + 1];
+		const int nextHeight = layout.heights[l + 1];
+		next.resize(nextWidth * nextHeight);
+
+		for (int y = 0; y < nextHeight; y++)
+		{
+			const int y0 = std::min(y * 2, height - 1);
+			const int y1 = std::min(y * 2 + 1, height - 1);
+
+			for (int x = 0; x < nextWidth; x++)
+			{
+				const int x0 = std::min(x * 2, width - 1);
+				const int x1 = std::min(x * 2 + 1, width - 1);
+				const std::uint32_t quad[4] = { level[y0 * width + x0], level[y0 * width + x1], level[y1 * width + x0], level[y1 * width + x1] };
+
+				std::uint32_t texel = 0;
+				for (int channel = 0; channel < 4; channel++)
+				{
+					const int shift = channel * 8;
+					std::uint32_t sum = 2;
+					for (int k = 0; k < 4; k++) sum += (quad[k] >> shift) & 0xFF;
+					texel |= (sum / 4) << shift;
+				}
+				next[y * nextWidth + x] = texel;
+			}
+		}
+
+		level.swap(next);
+	}
+}
+
+void Texture::Create(const TextureLayout& aLayout, const std::uint32_t* aTexels, std::shared_ptr<const MappedFile> aMapping)
+{
+	Clear();
+	layout = aLayout;
+	texels = aTexels;
+	mapping = std::move(aMapping);
+}
+
+void Texture::Clear()
+{
+	layout = {};
+	texels = nullptr;
+	storage.clear();
+	mapping.reset();
+}
+
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "MappedFile.h"
+
+namespace cga
+{
+
+// Enough for 32768 x 32768 maps
+const int MaxTextureLevels = 16;
+
+// Texels are stored in square tiles of this size, Morton ordered inside a tile
+const int TextureTileSize = 8;
+
+enum TextureFilter
+{
+	// Nearest texel of the full size level
+	FilterPoint,
+	// Bilinear on the nearest mip level
+	FilterBilinear,
+	// Bilinear on the two nearest mip levels, blended by the fractional LOD
+	FilterTrilinear
+};
+
+// Sizes and placement of every mip level, offsets and size are in texels
+struct TextureLayout
+{
+	int levels;
+	int widths[MaxTextureLevels];
+	int heights[MaxTextureLevels];
+	int tilesX[MaxTextureLevels];
+	int offsets[MaxTextureLevels];
+	int size;
+};
+
+// RGBA8 texture with a full mip chain. Every level is split into TextureTileSize x TextureTileSize tiles
+// stored one after another, so the four texels of a bilinear footprint are almost always in one or two cache lines.
+// Coordinates are clamped to the edge, v = 0 is the bottom row like in the OBJ files.
+class Texture
+{
+public:
+	Texture() = default;
+
+	// Texels may point into storage, moving keeps that valid but a copy would not
+	Texture(const Texture&) = delete;
+	Texture& operator=(const Texture&) = delete;
+	Texture(Texture&&) = default;
+	Texture& operator=(Texture&&) = default;
+
+	// Texels in row-major order, top row first, 4 bytes each
+	void Create(const unsigned char* rgba, int aWidth, int aHeight);
+
+	// Uses texels that are already tiled, e.g. from a mapped cache file, which is kept open as long as the texture uses it
+	void Create(const TextureLayout& aLayout, const std::uint32_t* aTexels, std::shared_ptr<const MappedFile> aMapping);
+
+	void Clear();
+
+	inline bool IsEmpty() const
+	{
+		return layout.levels == 0;
+	}
+
+	inline const TextureLayout& GetLayout() const
+	{
+		return layout;
+	}
+
+	inline int GetLevels() const
+	{
+		return layout.levels;
+	}
+
+	inline int GetWidth(int level = 0) const
+	{
+		return layout.widths[level];
+	}
+
+	inline int GetHeight(int level = 0) const
+	{
+		return layout.heights[level];
+	}
+
+	// Raw storage for the vectorized samplers, see GetAddress for the layout
+	inline const std::uint32_t* GetTexels() const
+	{
+		return texels;
+	}
+
+	inline const int* GetLevelWidths() const
+	{
+		return layout.widths;
+	}
+
+	inline const int* GetLevelHeights() const
+	{
+		return layout.heights;
+	}
+
+	inline const int* GetLevelTilesX() const
+	{
+		return layout.tilesX;
+	}
+
+	inline const int* GetLevelOffsets() const
+	{
+		return layout.offsets;
+	}
+
+	// Bit interleaving of the texel position inside its tile, x takes the even bits
+	static inline int GetMortonIndex(int x, int y)
+	{
+		return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) | ((x & 4) << 2) | ((y & 4) << 3);
+	}
+
+	inline int GetAddress(int level, int x, int y) const
+	{
+		const int tile = (y / TextureTileSize) * layout.tilesX[level] + x / TextureTileSize;
+		return layout.offsets[level] + tile * TextureTileSize * TextureTileSize + GetMortonIndex(x % TextureTileSize, y % TextureTileSize);
+	}
+
+	inline std::uint32_t Fetch(int level, int x, int y) const
+	{
+		return texels[GetAddress(level, x, y)];
+	}
+
+	// Level of detail from the texture coordinate derivatives along screen x and y
+	inline float GetLod(const glm::vec2& dx, const glm::vec2& dy) const
+	{
+		const glm::vec2 size((float)layout.widths[0], (float)layout.heights[0]);
+		const float rho = std::max(glm::dot(dx * size, dx * size), glm::dot(dy * size, dy * size));
+
+		// log2 of the squared footprint, halved
+		return rho > 0 ? 0.5f * std::log2(rho) : 0.0f;
+	}
+
+	// Channels in [0, 255]
+	inline glm::vec4 Sample(float u, float v, float lod, TextureFilter filter) const
+	{
+		if (filter == FilterPoint)
+		{
+			const int x = std::min((int)(u * layout.widths[0]), layout.widths[0] - 1);
+			const int y = std::min((int)((1 - v) * layout.heights[0]), layout.heights[0] - 1);
+			return Unpack(Fetch(0, std::max(x, 0), std::max(y, 0)));
+		}
+
+		lod = std::clamp(lod, 0.0f, (float)(layout.levels - 1));
+
+		if (filter == FilterBilinear)
+		{
+			return SampleBilinear((int)(lod + 0.5f), u, v);
+		}
+
+		const int level = (int)lod;
+		const float fraction = lod - level;
+		if (fraction == 0) return SampleBilinear(level, u, v);
+
+		return glm::mix(SampleBilinear(level, u, v), SampleBilinear(level + 1, u, v), fraction);
+	}
+
+	inline glm::vec4 SampleBilinear(int level, float u, float v) const
+	{
+		const int width = layout.widths[level];
+		const int height = layout.heights[level];
+
+		// Texel centers are at half coordinates
+		const float x = u * width - 0.5f;
+		const float y = (1 - v) * height - 0.5f;
+		const float x0f = std::floor(x);
+		const float y0f = std::floor(y);
+		const float fx = x - x0f;
+		const float fy = y - y0f;
+
+		const int x0 = std::clamp((int)x0f, 0, width - 1);
+		const int y0 = std::clamp((int)y0f, 0, height - 1);
+		const int x1 = std::clamp((int)x0f + 1, 0, width - 1);
+		const int y1 = std::clamp((int)y0f + 1, 0, height - 1);
+
+		const glm::vec4 top = glm::mix(Unpack(Fetch(level, x0, y0)), Unpack(Fetch(level, x1, y0)), fx);
+		const glm::vec4 bottom = glm::mix(Unpack(Fetch(level, x0, y1)), Unpack(Fetch(level, x1, y1)), fx);
+		return glm::mix(top, bottom, fy);
+	}
+
+	static inline glm::vec4 Unpack(std::uint32_t texel)
+	{
+		return glm::vec4((float)(texel & 0xFF), (float)((texel >> 8) & 0xFF), (float)((texel >> 16) & 0xFF), (float)(texel >> 24));
+	}
+
+private:
+	TextureLayout layout = {};
+	const std::uint32_t* texels = nullptr;
+
+	// Owns the texels when the texture was built in memory, otherwise they live in the mapping
+	std::vector<std::uint32_t> storage;
+	std::shared_ptr<const MappedFile> mapping;
+};
+
+}
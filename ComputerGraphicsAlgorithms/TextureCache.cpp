@@ -0,0 +1,93 @@
+#include "TextureCache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "lodepng.h"
+
+namespace cga
+{
+
+namespace
+{
+
+const char TextureCacheMagic[4] = { 'C', 'G', 'A', 'T' };
+
+// The chain Texture::Create builds: every level half the size of the previous one, rounded down, and tiled inside
+// the texels, so that no fetch can leave them
+bool IsLayoutValid(const TextureLayout& layout)
+{
+	if (layout.levels <= 0 || layout.levels > MaxTextureLevels || layout.size <= 0) return false;
+
+	const int maxSize = 1 << (MaxTextureLevels - 1);
+	if (layout.widths[0] <= 0 || layout.heights[0] <= 0 || layout.widths[0] > maxSize || layout.heights[0] > maxSize) return false;
+
+	for (int level = 0; level < layout.levels; level++)
+	{
+		const int width = layout.widths[level];
+		const int height = layout.heights[level];
+		if (level > 0 && (width != std::max(layout.widths[level - 1] / 2, 1) || height != std::max(layout.heights[level - 1] / 2, 1))) return false;
+
+		const std::int64_t tilesY = (height + TextureTileSize - 1) / TextureTileSize;
+		if (layout.tilesX[level] != (width + TextureTileSize - 1) / TextureTileSize || layout.offsets[level] < 0) return false;
+		if (layout.offsets[level] + layout.tilesX[level] * tilesY * TextureTileSize * TextureTileSize > layout.size) return false;
+	}
+
+	return true;
+}
+
+}
+
+bool TextureCache::Load(const std::string& sourcePath, Texture& texture)
+{
+	CacheKey key;
+	if (!CacheFile::GetKey(sourcePath, TextureCacheMagic, TextureCacheVersion, key)) return false;
+
+	if (Map(sourcePath, key, texture)) return true;
+
+	std::vector<unsigned char> image;
+	unsigned width = 0, height = 0;
+	if (lodepng::decode(image, width, height, sourcePath) != 0) return false;
+
+	texture.Create(image.data(), width, height);
+	Write(sourcePath, key, texture);
+	return true;
+}
+
+bool TextureCache::Map(const std::string& sourcePath, const CacheKey& key, Texture& texture)
+{
+	auto file = std::make_shared<MappedFile>();
+	Header header;
+	if (!CacheFile::Open(sourcePath, key, *file, header)) return false;
+
+	const TextureLayout& layout = header.layout;
+	if (!IsLayoutValid(layout)) return false;
+	if (header.texelsOffset % TextureCacheAlignment != 0 || header.texelsOffset > file->GetSize() ||
+		(std::size_t)layout.size > (file->GetSize() - header.texelsOffset) / sizeof(std::uint32_t)) return false;
+
+	const std::uint32_t* texels = reinterpret_cast<const std::uint32_t*>(file->GetData() + header.texelsOffset);
+	texture.Create(layout, texels, std::move(file));
+	return true;
+}
+
+void TextureCache::Write(const std::string& sourcePath, const CacheKey& key, const Texture& texture)
+{
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	header.key = key;
+	header.layout = texture.GetLayout();
+	header.texelsOffset = CacheFile::GetDataOffset(sizeof(Header), key, TextureCacheAlignment);
+
+	CacheFile::Write(sourcePath, header, [&](std::ofstream& file)
+	{
+		const std::vector<char> padding(header.texelsOffset - sizeof(Header) - key.pathLength, 0);
+		file.write(padding.data(), padding.size());
+		file.write(reinterpret_cast<const char*>(texture.GetTexels()), (std::streamsize)header.layout.size * sizeof(std::uint32_t));
+	});
+}
+
+}
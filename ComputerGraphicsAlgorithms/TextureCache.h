@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "CacheFile.h"
+#include "Texture.h"
+
+namespace cga
+{
+
+// Bumped whenever the header, the layout or the texel order changes
+const std::uint32_t TextureCacheVersion = 2;
+
+// Texels start at a multiple of this in the cache file, enough for aligned vector loads
+const std::uint32_t TextureCacheAlignment = 64;
+
+// Loads PNG textures through a binary cache stored next to them, see CacheFile. The cache holds the tiled
+// texels of every mip level and is mapped instead of read, so a warm load costs no decode and no copies.
+class TextureCache
+{
+public:
+	// False when neither the cache nor the PNG could be loaded
+	bool Load(const std::string& sourcePath, Texture& texture);
+
+protected:
+	struct Header
+	{
+		CacheKey key;
+		std::uint64_t texelsOffset;
+		TextureLayout layout;
+	};
+
+	bool Map(const std::string& sourcePath, const CacheKey& key, Texture& texture);
+	void Write(const std::string& sourcePath, const CacheKey& key, const Texture& texture);
+};
+
+}
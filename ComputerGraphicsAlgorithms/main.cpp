@@ -25,6 +25,7 @@ HWND hWnd;
 
 void OnInvalidated();
 void OnCreate(HWND hWnd);
+void UpdateTitle();
 
 std::unique_ptr<cga::Game> game;
 
@@ -151,6 +152,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		break;
 	case WM_TIMER:
 		game->GameCycle();
+		UpdateTitle();
 		break;
     case WM_COMMAND:
         {
@@ -211,8 +213,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             PAINTSTRUCT ps;
 			HDC hdc = BeginPaint(hWnd, &ps);
 
+			// Rows are pitch bytes apart, the padding columns are not blitted
+			auto& buffer = game->GetCurrentBuffer();
 			auto memoryDC = CreateCompatibleDC(hdc);
-			HBITMAP map = CreateBitmap(WIDTH, HEIGHT, 1, 8 * sizeof(COLORREF), (void*)game->GetCurrentBuffer().data);
+			HBITMAP map = CreateBitmap(buffer.GetPitch() / sizeof(COLORREF), HEIGHT, 1, 8 * sizeof(COLORREF), (void*)buffer.GetData());
 			auto old = SelectObject(memoryDC, map);
 
 			BitBlt(hdc, 0, 0, WIDTH, HEIGHT, memoryDC, 0, 0, SRCCOPY);
@@ -261,4 +265,19 @@ void OnInvalidated()
 void OnCreate(HWND hWnd)
 {
 	SetTimer(hWnd, IDT_TIMER, 15, (TIMERPROC)NULL);
+}
+
+// Shows the loading progress after the title while a scene loads
+void UpdateTitle()
+{
+	static int shownPercent = -1;
+
+	const int percent = game->IsLoading() ? (int)(game->GetLoadingProgress() * 100) : -1;
+	if (percent == shownPercent) return;
+	shownPercent = percent;
+
+	WCHAR title[MAX_LOADSTRING + 32];
+	if (percent < 0) swprintf_s(title, L"%s", szTitle);
+	else swprintf_s(title, L"%s - loading %d%%", szTitle, percent);
+	SetWindowTextW(hWnd, title);
 }
\ No newline at end of file